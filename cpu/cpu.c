@@ -8,19 +8,32 @@
  *   https://creativecommons.org/publicdomain/zero/1.0/
  */
 
+#define _GNU_SOURCE
+
 #include "cpu.h"
 
 #if !defined(PSNIP_ONCE__H)
 #  include "../once/once.h"
 #endif
+#if !defined(PSNIP_CLOCK_H)
+#  include "../clock/clock.h"
+#endif
 
 #include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #if defined(_WIN32)
 #  include <Windows.h>
 #  define PSNIP_CPU__IMPL_WIN32
 #elif defined(unix) || defined(__unix__) || defined(__unix)
 #  include <unistd.h>
+#  if defined(__linux__)
+#    include <errno.h>
+#    include <sched.h>
+#    include <sys/syscall.h>
+#  endif
 #  if defined(_SC_NPROCESSORS_ONLN) || defined(_SC_NPROC_ONLN)
 #    define PSNIP_CPU__IMPL_SYSCONF
 #  else
@@ -30,62 +43,169 @@
 
 #if defined(PSNIP_CPU_ARCH_X86) || defined(PSNIP_CPU_ARCH_X86_64)
 #  if defined(_MSC_VER)
-static void psnip_cpu_getid(int func, int* data) {
-  __cpuid(data, func);
+#  include <intrin.h>
+static void psnip_cpu_getid_count(int func, int subfunc, int* data) {
+  __cpuidex(data, func, subfunc);
 }
 #  else
-static void psnip_cpu_getid(int func, int* data) {
+static void psnip_cpu_getid_count(int func, int subfunc, int* data) {
   __asm__ ("cpuid"
 	   : "=a" (data[0]), "=b" (data[1]), "=c" (data[2]), "=d" (data[3])
-	   : "0" (func), "2" (0));
+	   : "0" (func), "2" (subfunc));
 }
 #  endif
+static void psnip_cpu_getid(int func, int* data) {
+  psnip_cpu_getid_count(func, 0, data);
+}
 #elif defined(PSNIP_CPU_ARCH_ARM) || defined(PSNIP_CPU_ARCH_ARM64)
-#  if (defined(__GNUC__) && ((__GNUC__ > 2) || (__GNUC__ == 2 && __GNUC_MINOR__ >= 16)))
+/* getauxval is in glibc 2.16+ and bionic. */
+#  if (defined(__GLIBC__) && ((__GLIBC__ > 2) || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 16))) || \
+  defined(__ANDROID__)
 #    define PSNIP_CPU__IMPL_GETAUXVAL
 #    include <sys/auxv.h>
 #  endif
+#  if defined(__linux__) && defined(PSNIP_CPU_ARCH_ARM64)
+#    include <sys/prctl.h>
+#  endif
 #endif
 
 static psnip_once psnip_cpu_once = PSNIP_ONCE_INIT;
 
 #if defined(PSNIP_CPU_ARCH_X86) || defined(PSNIP_CPU_ARCH_X86_64)
-static unsigned int psnip_cpuinfo[8 * 4] = { 0, };
-#elif defined(PSNIP_CPU_ARCH_ARM) || defined(PSNIP_CPU_ARCH_ARM_64)
-static unsigned long psnip_cpuinfo[2] = { 0, };
+unsigned int psnip_cpu__info[PSNIP_CPU__X86_INFO_SLOTS * 4] = { 0, };
+#elif defined(PSNIP_CPU_ARCH_ARM) || defined(PSNIP_CPU_ARCH_ARM64)
+unsigned long psnip_cpu__info[2] = { 0, };
 #endif
+int psnip_cpu__info_ready = 0;
 
-static void psnip_cpu_init(void) {
 #if defined(PSNIP_CPU_ARCH_X86) || defined(PSNIP_CPU_ARCH_X86_64)
-  int i;
-  for (i = 0 ; i < 8 ; i++) {
-    psnip_cpu_getid(i, (int*) &(psnip_cpuinfo[i * 4]));
-  }
-#elif defined(PSNIP_CPU_ARCH_ARM) || defined(PSNIP_CPU_ARCH_ARM_64)
-  psnip_cpuinfo[0] = getauxval (AT_HWCAP);
-  psnip_cpuinfo[1] = getauxval (AT_HWCAP2);
+/* Features which use register state the OS has to save and restore,
+ * grouped by the XCR0 bits they need. */
+static const enum PSnipCPUFeature psnip_cpu_avx_features[] = {
+  PSNIP_CPU_FEATURE_X86_AVX, PSNIP_CPU_FEATURE_X86_AVX2, PSNIP_CPU_FEATURE_X86_FMA,
+  PSNIP_CPU_FEATURE_X86_F16C, PSNIP_CPU_FEATURE_X86_VAES, PSNIP_CPU_FEATURE_X86_VPCLMULQDQ,
+  PSNIP_CPU_FEATURE_X86_AVX_VNNI, PSNIP_CPU_FEATURE_X86_AVX_IFMA, PSNIP_CPU_FEATURE_X86_AVX_VNNI_INT8,
+  PSNIP_CPU_FEATURE_X86_AVX_NE_CONVERT, PSNIP_CPU_FEATURE_X86_XOP, PSNIP_CPU_FEATURE_X86_FMA4,
+  PSNIP_CPU_FEATURE_NONE
+};
+
+static const enum PSnipCPUFeature psnip_cpu_avx512_features[] = {
+  PSNIP_CPU_FEATURE_X86_AVX512F, PSNIP_CPU_FEATURE_X86_AVX512DQ, PSNIP_CPU_FEATURE_X86_AVX512IFMA,
+  PSNIP_CPU_FEATURE_X86_AVX512PF, PSNIP_CPU_FEATURE_X86_AVX512ER, PSNIP_CPU_FEATURE_X86_AVX512CD,
+  PSNIP_CPU_FEATURE_X86_AVX512BW, PSNIP_CPU_FEATURE_X86_AVX512VL, PSNIP_CPU_FEATURE_X86_AVX512VBMI,
+  PSNIP_CPU_FEATURE_X86_AVX512VBMI2, PSNIP_CPU_FEATURE_X86_AVX512VNNI, PSNIP_CPU_FEATURE_X86_AVX512BITALG,
+  PSNIP_CPU_FEATURE_X86_AVX512VPOPCNTDQ, PSNIP_CPU_FEATURE_X86_AVX512_4VNNIW, PSNIP_CPU_FEATURE_X86_AVX512_4FMAPS,
+  PSNIP_CPU_FEATURE_X86_AVX512VP2INTERSECT, PSNIP_CPU_FEATURE_X86_AVX512FP16, PSNIP_CPU_FEATURE_X86_AVX512BF16,
+  PSNIP_CPU_FEATURE_NONE
+};
+
+static const enum PSnipCPUFeature psnip_cpu_amx_features[] = {
+  PSNIP_CPU_FEATURE_X86_AMX_BF16, PSNIP_CPU_FEATURE_X86_AMX_TILE, PSNIP_CPU_FEATURE_X86_AMX_INT8,
+  PSNIP_CPU_FEATURE_X86_AMX_FP16, PSNIP_CPU_FEATURE_X86_AMX_COMPLEX,
+  PSNIP_CPU_FEATURE_NONE
+};
+
+#define PSNIP_CPU__XCR0_SSE       (1U << 1)
+#define PSNIP_CPU__XCR0_AVX       (1U << 2)
+#define PSNIP_CPU__XCR0_OPMASK    (1U << 5)
+#define PSNIP_CPU__XCR0_ZMM_HI256 (1U << 6)
+#define PSNIP_CPU__XCR0_HI16_ZMM  (1U << 7)
+#define PSNIP_CPU__XCR0_TILECFG   (1U << 17)
+#define PSNIP_CPU__XCR0_TILEDATA  (1U << 18)
+
+static unsigned int
+psnip_cpu_info_index(enum PSnipCPUFeature feature) {
+  return ((feature >> 16) & 0xff) * 4 + ((feature >> 8) & 0xff);
+}
+
+static void
+psnip_cpu_clear(unsigned int* info, const enum PSnipCPUFeature* features) {
+  for ( ; *features != PSNIP_CPU_FEATURE_NONE ; features++)
+    info[psnip_cpu_info_index(*features)] &= ~(1U << (*features & 0xff));
+}
+
+/* Low 32 bits of XCR0.  Only call this if OSXSAVE is set. */
+static unsigned int
+psnip_cpu_xgetbv(void) {
+#if defined(_MSC_VER)
+  return (unsigned int) _xgetbv(0);
+#else
+  unsigned int eax, edx;
+  __asm__ __volatile__ (".byte 0x0f, 0x01, 0xd0" /* xgetbv */
+			: "=a" (eax), "=d" (edx)
+			: "c" (0));
+  (void) edx;
+  return eax;
 #endif
 }
+#endif
 
-int
-psnip_cpu_feature_check (enum PSnipCPUFeature feature) {
+static void psnip_cpu_init(void) {
 #if defined(PSNIP_CPU_ARCH_X86) || defined(PSNIP_CPU_ARCH_X86_64)
-  unsigned int i, r, b;
-#elif defined(PSNIP_CPU_ARCH_ARM) || defined(PSNIP_CPU_ARCH_ARM_64)
-  unsigned long b, i;
+  /* The inline feature check reads psnip_cpu__info without waiting for
+   * us, so fill in (and mask) a local copy, then publish it. */
+  unsigned int info[PSNIP_CPU__X86_INFO_SLOTS * 4] = { 0, };
+  unsigned int regs[4];
+  unsigned int i, max_leaf, xcr0 = 0;
+
+  psnip_cpu_getid(0, (int*) &(info[0]));
+  max_leaf = info[0];
+  for (i = 1 ; i < 8 && i <= max_leaf ; i++) {
+    psnip_cpu_getid((int) i, (int*) &(info[i * 4]));
+  }
+  /* EAX=7 reports the highest subleaf in EAX. */
+  if (max_leaf >= 7 && info[7 * 4] >= 1)
+    psnip_cpu_getid_count(7, 1, (int*) &(info[8 * 4]));
+
+  psnip_cpu_getid((int) 0x80000000U, (int*) regs);
+  if (regs[0] >= 0x80000001U && regs[0] <= 0x8000ffffU)
+    psnip_cpu_getid((int) 0x80000001U, (int*) &(info[9 * 4]));
+  if (regs[0] >= 0x80000007U && regs[0] <= 0x8000ffffU)
+    psnip_cpu_getid((int) 0x80000007U, (int*) &(info[10 * 4]));
+
+  if ((info[psnip_cpu_info_index(PSNIP_CPU_FEATURE_X86_OSXSAVE)] >> (PSNIP_CPU_FEATURE_X86_OSXSAVE & 0xff)) & 1)
+    xcr0 = psnip_cpu_xgetbv();
+
+  if ((xcr0 & (PSNIP_CPU__XCR0_SSE | PSNIP_CPU__XCR0_AVX)) != (PSNIP_CPU__XCR0_SSE | PSNIP_CPU__XCR0_AVX)) {
+    psnip_cpu_clear(info, psnip_cpu_avx_features);
+    xcr0 = 0;
+  }
+  if ((xcr0 & (PSNIP_CPU__XCR0_OPMASK | PSNIP_CPU__XCR0_ZMM_HI256 | PSNIP_CPU__XCR0_HI16_ZMM)) !=
+      (PSNIP_CPU__XCR0_OPMASK | PSNIP_CPU__XCR0_ZMM_HI256 | PSNIP_CPU__XCR0_HI16_ZMM))
+    psnip_cpu_clear(info, psnip_cpu_avx512_features);
+  if ((xcr0 & (PSNIP_CPU__XCR0_TILECFG | PSNIP_CPU__XCR0_TILEDATA)) != (PSNIP_CPU__XCR0_TILECFG | PSNIP_CPU__XCR0_TILEDATA)) {
+    psnip_cpu_clear(info, psnip_cpu_amx_features);
+  } else {
+#if defined(__linux__) && defined(PSNIP_CPU_ARCH_X86_64) && defined(SYS_arch_prctl)
+    /* Linux also requires each process to ask for permission to use
+     * the AMX tile data (ARCH_REQ_XCOMP_PERM) before touching it. */
+    unsigned long perm = 0;
+    if (syscall(SYS_arch_prctl, 0x1022 /* ARCH_GET_XCOMP_PERM */, &perm) != 0 ||
+	(perm & PSNIP_CPU__XCR0_TILEDATA) == 0)
+      psnip_cpu_clear(info, psnip_cpu_amx_features);
 #endif
+  }
 
-#if defined(PSNIP_CPU_ARCH_X86) || defined(PSNIP_CPU_ARCH_X86_64)
-  if ((feature & PSNIP_CPU_FEATURE_CPU_MASK) != PSNIP_CPU_FEATURE_X86)
-    return 0;
-#elif defined(PSNIP_CPU_ARCH_ARM) || defined(PSNIP_CPU_ARCH_ARM_64)
-  if ((feature & PSNIP_CPU_FEATURE_CPU_MASK) != PSNIP_CPU_FEATURE_ARM)
-    return 0;
+  for (i = 0 ; i < PSNIP_CPU__X86_INFO_SLOTS * 4 ; i++)
+    psnip_cpu__info[i] = info[i];
+#elif (defined(PSNIP_CPU_ARCH_ARM) || defined(PSNIP_CPU_ARCH_ARM64)) && defined(PSNIP_CPU__IMPL_GETAUXVAL)
+  psnip_cpu__info[0] = getauxval (AT_HWCAP);
+#  if defined(AT_HWCAP2)
+  psnip_cpu__info[1] = getauxval (AT_HWCAP2);
+#  endif
+#endif
+
+#if defined(__ATOMIC_RELEASE) && !defined(__INTEL_COMPILER)
+  __atomic_store_n(&psnip_cpu__info_ready, 1, __ATOMIC_RELEASE);
 #else
-  return 0;
+  *((volatile int*) &psnip_cpu__info_ready) = 1;
 #endif
+}
 
-  feature &= (enum PSnipCPUFeature) ~PSNIP_CPU_FEATURE_CPU_MASK;
+/* The slow path of psnip_cpu_feature_check, for when the information
+ * hasn't been gathered yet. */
+int
+psnip_cpu__feature_check_init (enum PSnipCPUFeature feature) {
 #if defined(_MSC_VER)
 #pragma warning(push)
 #pragma warning(disable:4152)
@@ -95,33 +215,129 @@ psnip_cpu_feature_check (enum PSnipCPUFeature feature) {
 #pragma warning(pop)
 #endif
 
+  return psnip_cpu__feature_lookup(feature);
+}
+
+int
+psnip_cpu_feature_check_many (enum PSnipCPUFeature* feature) {
+  int n;
+
+  for (n = 0 ; feature[n] != PSNIP_CPU_FEATURE_NONE ; n++)
+    if (!psnip_cpu_feature_check(feature[n]))
+      return 0;
+
+  return 1;
+}
+
+PSnipCPUFunction
+psnip_cpu_dispatch_select (const struct PSnipCPUDispatch* table) {
+  for ( ; table->function != NULL ; table++)
+    if (table->features == NULL || psnip_cpu_feature_check_many(table->features))
+      return table->function;
+
+  return NULL;
+}
+
+/* Used by PSNIP_CPU_DISPATCH, which has nothing sensible to call if
+ * the table doesn't match (i.e., it has no generic entry). */
+PSnipCPUFunction
+psnip_cpu__dispatch_resolve (const struct PSnipCPUDispatch* table, const char* name) {
+  PSnipCPUFunction function = psnip_cpu_dispatch_select(table);
+
+  if (function == NULL) {
+    fprintf(stderr, "psnip_cpu: no implementation of %s for this CPU\n", name);
+    abort();
+  }
+
+  return function;
+}
+
 #if defined(PSNIP_CPU_ARCH_X86) || defined(PSNIP_CPU_ARCH_X86_64)
+static int
+psnip_cpu_feature_in (enum PSnipCPUFeature feature, const enum PSnipCPUFeature* features) {
+  for ( ; *features != PSNIP_CPU_FEATURE_NONE ; features++)
+    if (*features == feature)
+      return 1;
+
+  return 0;
+}
+
+/* psnip_cpu_feature_check for ifunc resolvers.  Those run while the
+ * program is still being relocated, so this only uses CPUID and
+ * XGETBV: no psnip_once, no libc and no global state.  AMX is never
+ * reported since the process can't have asked Linux for permission
+ * to use it yet. */
+static int
+psnip_cpu_feature_check_early (enum PSnipCPUFeature feature) {
+  unsigned int regs[4];
+  unsigned int i, r, b, leaf, subleaf, xcr0 = 0;
+
+  if (psnip_cpu__feature_compiled(feature))
+    return 1;
+  if ((feature & PSNIP_CPU_FEATURE_CPU_MASK) != PSNIP_CPU_FEATURE_X86)
+    return 0;
+
   i = (feature >> 16) & 0xff;
   r = (feature >>  8) & 0xff;
   b = (feature      ) & 0xff;
 
-  if (i > 7 || r > 3 || b > 31)
+  if (i >= PSNIP_CPU__X86_INFO_SLOTS || r > 3 || b > 31)
+    return 0;
+  if (psnip_cpu_feature_in(feature, psnip_cpu_amx_features))
     return 0;
 
-  return (psnip_cpuinfo[(i * 4) + r] >> b) & 1;
-#elif defined(PSNIP_CPU_ARCH_ARM) || defined(PSNIP_CPU_ARCH_ARM_64)
-  b = 1 << ((feature & 0xff) - 1);
-  i = psnip_cpuinfo[(feature >> 0x08) & 0xff];
-  return (psnip_cpuinfo[(feature >> 0x08) & 0xff] & b) == b;
-#endif
-}
+  /* The leaf psnip_cpu_init stores in slot i. */
+  leaf = (i < 8) ? i : (i == 8) ? 7 : (i == 9) ? 0x80000001U : 0x80000007U;
+  subleaf = (i == 8) ? 1 : 0;
 
-int
-psnip_cpu_feature_check_many (enum PSnipCPUFeature* feature) {
-  int n;
+  psnip_cpu_getid((int) (leaf & 0x80000000U), (int*) regs);
+  if (regs[0] < leaf || ((leaf & 0x80000000U) != 0 && regs[0] > 0x8000ffffU))
+    return 0;
+  if (subleaf != 0) {
+    psnip_cpu_getid((int) leaf, (int*) regs);
+    if (regs[0] < subleaf)
+      return 0;
+  }
 
-  for (n = 0 ; feature[n] != PSNIP_CPU_FEATURE_NONE ; n++)
-    if (!psnip_cpu_feature_check(feature[n]))
+  psnip_cpu_getid_count((int) leaf, (int) subleaf, (int*) regs);
+  if (((regs[r] >> b) & 1) == 0)
+    return 0;
+
+  if (psnip_cpu_feature_in(feature, psnip_cpu_avx_features) ||
+      psnip_cpu_feature_in(feature, psnip_cpu_avx512_features)) {
+    psnip_cpu_getid(1, (int*) regs);
+    if ((regs[(PSNIP_CPU_FEATURE_X86_OSXSAVE >> 8) & 0xff] >> (PSNIP_CPU_FEATURE_X86_OSXSAVE & 0xff)) & 1)
+      xcr0 = psnip_cpu_xgetbv();
+
+    if ((xcr0 & (PSNIP_CPU__XCR0_SSE | PSNIP_CPU__XCR0_AVX)) != (PSNIP_CPU__XCR0_SSE | PSNIP_CPU__XCR0_AVX))
       return 0;
+    if (psnip_cpu_feature_in(feature, psnip_cpu_avx512_features) &&
+	(xcr0 & (PSNIP_CPU__XCR0_OPMASK | PSNIP_CPU__XCR0_ZMM_HI256 | PSNIP_CPU__XCR0_HI16_ZMM)) !=
+	(PSNIP_CPU__XCR0_OPMASK | PSNIP_CPU__XCR0_ZMM_HI256 | PSNIP_CPU__XCR0_HI16_ZMM))
+      return 0;
+  }
 
   return 1;
 }
 
+/* psnip_cpu_dispatch_select for ifunc resolvers. */
+PSnipCPUFunction
+psnip_cpu__dispatch_select_early (const struct PSnipCPUDispatch* table) {
+  enum PSnipCPUFeature* feature;
+
+  for ( ; table->function != NULL ; table++) {
+    for (feature = table->features ; feature != NULL && *feature != PSNIP_CPU_FEATURE_NONE ; feature++)
+      if (!psnip_cpu_feature_check_early(*feature))
+	break;
+
+    if (feature == NULL || *feature == PSNIP_CPU_FEATURE_NONE)
+      return table->function;
+  }
+
+  return NULL;
+}
+#endif
+
 int
 psnip_cpu_count (void) {
   static int count = 0;
@@ -165,3 +381,1253 @@ psnip_cpu_count (void) {
 
   return count;
 }
+
+#if defined(__linux__)
+/* Reads a (short) sysfs attribute, without the trailing newline.
+ * Returns 0 if it can't be read. */
+static int
+psnip_cpu_sysfs_read(const char* path, char* buf, size_t buf_size) {
+  FILE* fp;
+  size_t len;
+
+  fp = fopen(path, "r");
+  if (fp == NULL)
+    return 0;
+  len = fread(buf, 1, buf_size - 1, fp);
+  fclose(fp);
+
+  while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == ' '))
+    len--;
+  buf[len] = '\0';
+
+  return len > 0;
+}
+
+/* Parses the next range from a list like "0-3,8,10-11", advancing
+ * *list past it.  Returns 0 at the end of the list. */
+static int
+psnip_cpu_list_next(const char** list, unsigned long* first, unsigned long* last) {
+  char* end;
+
+  *first = *last = strtoul(*list, &end, 10);
+  if (end == *list)
+    return 0;
+  if (*end == '-')
+    *last = strtoul(end + 1, &end, 10);
+  *list = (*end == ',') ? end + 1 : end;
+
+  return 1;
+}
+
+/* Number of CPUs in a list like "0-3,8,10-11". */
+static int
+psnip_cpu_list_count(const char* list) {
+  unsigned long first, last;
+  int count = 0;
+
+  while (psnip_cpu_list_next(&list, &first, &last))
+    if (last >= first)
+      count += (int) (last - first) + 1;
+
+  return count;
+}
+
+/* Number of CPUs in the list lower than cpu. */
+static int
+psnip_cpu_list_rank(const char* list, unsigned long cpu) {
+  unsigned long first, last;
+  int rank = 0;
+
+  while (psnip_cpu_list_next(&list, &first, &last)) {
+    if (last >= cpu)
+      last = cpu - 1;
+    if (first <= last && first < cpu)
+      rank += (int) (last - first) + 1;
+  }
+
+  return rank;
+}
+#endif
+
+/* The kernel tells us the vector length for the calling thread (it
+ * can be changed per thread, with PR_SVE_SET_VL). */
+int
+psnip_cpu_sve_vector_length (void) {
+#if defined(PSNIP_CPU_ARCH_ARM64) && defined(__linux__)
+  int r;
+
+  if (!psnip_cpu_feature_check(PSNIP_CPU_FEATURE_ARM64_SVE))
+    return 0;
+
+  r = prctl(51 /* PR_SVE_GET_VL */);
+  if (r < 0)
+    return 0;
+
+  return r & 0xffff; /* PR_SVE_VL_LEN_MASK */
+#else
+  return 0;
+#endif
+}
+
+/* Available CPUs
+ *
+ * psnip_cpu_count reports every online CPU, but on Linux the process
+ * may be restricted to fewer with sched_setaffinity (or a cpuset), or
+ * given a CFS bandwidth quota by its cgroup, which is how container
+ * runtimes implement CPU limits.  This is the number of threads it
+ * makes sense to keep busy. */
+
+static int psnip_cpu_available = 0;
+static psnip_once psnip_cpu_available_once = PSNIP_ONCE_INIT;
+
+#if defined(__linux__)
+#if defined(CPU_COUNT_S)
+/* The calling thread's affinity mask; the kernel may support more CPUs
+ * than cpu_set_t does, so the set is allocated dynamically.  Free the
+ * result with CPU_FREE. */
+static cpu_set_t*
+psnip_cpu_affinity_get(size_t* size, int* max_cpus) {
+  cpu_set_t* set;
+  int n;
+
+  for (n = CPU_SETSIZE ; n <= (1 << 20) ; n *= 2) {
+    set = CPU_ALLOC(n);
+    if (set == NULL)
+      break;
+    *size = CPU_ALLOC_SIZE(n);
+    *max_cpus = n;
+    if (sched_getaffinity(0, *size, set) == 0)
+      return set;
+    CPU_FREE(set);
+    if (errno != EINVAL)
+      break;
+  }
+
+  return NULL;
+}
+#endif
+
+static int
+psnip_cpu_affinity_count(void) {
+#if defined(CPU_COUNT_S)
+  cpu_set_t* set;
+  size_t size;
+  int n, c;
+
+  set = psnip_cpu_affinity_get(&size, &n);
+  if (set == NULL)
+    return 0;
+  c = CPU_COUNT_S(size, set);
+  CPU_FREE(set);
+
+  return c;
+#else
+  return 0;
+#endif
+}
+
+/* Whether a comma-separated list of options contains name. */
+static int
+psnip_cpu_option_has(const char* options, const char* name) {
+  const size_t len = strlen(name);
+
+  while (options != NULL) {
+    if (strncmp(options, name, len) == 0 && (options[len] == ',' || options[len] == '\0'))
+      return 1;
+    options = strchr(options, ',');
+    if (options != NULL)
+      options++;
+  }
+
+  return 0;
+}
+
+/* Reads the quota and period from a cgroup directory.  Returns the
+ * number of CPUs it allows (rounded up), or 0 if it is unlimited. */
+static int
+psnip_cpu_cgroup_quota(const char* dir, int v2) {
+  char path[4096 + 32], buf[64];
+  char* end;
+  long long quota, period;
+
+  if (v2) {
+    sprintf(path, "%s/cpu.max", dir);
+    if (!psnip_cpu_sysfs_read(path, buf, sizeof(buf)))
+      return 0;
+    quota = strtoll(buf, &end, 10);
+    if (end == buf)
+      return 0; /* "max" */
+    period = strtoll(end, NULL, 10);
+  } else {
+    sprintf(path, "%s/cpu.cfs_quota_us", dir);
+    if (!psnip_cpu_sysfs_read(path, buf, sizeof(buf)))
+      return 0;
+    quota = strtoll(buf, NULL, 10);
+    sprintf(path, "%s/cpu.cfs_period_us", dir);
+    if (!psnip_cpu_sysfs_read(path, buf, sizeof(buf)))
+      return 0;
+    period = strtoll(buf, NULL, 10);
+  }
+
+  if (quota <= 0 || period <= 0)
+    return 0;
+
+  return (int) ((quota + period - 1) / period);
+}
+
+/* The cgroup with the cpu controller is found in /proc/self/cgroup
+ * (v1 lists the controller, v2 uses hierarchy 0), and mapped onto
+ * the filesystem using /proc/self/mountinfo.  Inside a cgroup
+ * namespace the mount root is the cgroup itself.  A limit on any
+ * ancestor applies too, so we take the smallest one. */
+static int
+psnip_cpu_cgroup_count(void) {
+  char line[4096], cgroup[4096], root[4096], mount[4096], fstype[64], options[1024];
+  char dir[4096];
+  const char* sep;
+  const char* rel;
+  char* p;
+  FILE* fp;
+  int v2 = 0, found = 0, limit = 0, c;
+  size_t mount_len;
+
+  cgroup[0] = '\0';
+  fp = fopen("/proc/self/cgroup", "r");
+  if (fp == NULL)
+    return 0;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    /* id:controllers:path */
+    if ((sep = strchr(line, ':')) == NULL || (p = strchr(sep + 1, ':')) == NULL)
+      continue;
+    *p = '\0';
+    if (psnip_cpu_option_has(sep + 1, "cpu")) {
+      v2 = 0;
+    } else if (p == sep + 1 && strncmp(line, "0:", 2) == 0 && cgroup[0] == '\0') {
+      v2 = 1;
+    } else {
+      continue;
+    }
+    strcpy(cgroup, p + 1);
+    cgroup[strcspn(cgroup, "\n")] = '\0';
+    if (!v2)
+      break;
+  }
+  fclose(fp);
+  if (cgroup[0] == '\0')
+    return 0;
+
+  fp = fopen("/proc/self/mountinfo", "r");
+  if (fp == NULL)
+    return 0;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    /* id parent major:minor root mount-point options ... - fstype source super-options */
+    if (sscanf(line, "%*s %*s %*s %4095s %4095s", root, mount) != 2)
+      continue;
+    if ((sep = strstr(line, " - ")) == NULL)
+      continue;
+    if (sscanf(sep + 3, "%63s %*s %1023s", fstype, options) != 2)
+      continue;
+    if (v2 ? (strcmp(fstype, "cgroup2") == 0) :
+	(strcmp(fstype, "cgroup") == 0 && psnip_cpu_option_has(options, "cpu"))) {
+      found = 1;
+      break;
+    }
+  }
+  fclose(fp);
+  if (!found)
+    return 0;
+
+  rel = cgroup;
+  if (strcmp(root, "/") != 0 && strncmp(cgroup, root, strlen(root)) == 0)
+    rel = cgroup + strlen(root);
+  if (strcmp(rel, "/") == 0)
+    rel = "";
+  mount_len = strlen(mount);
+  if (mount_len + strlen(rel) >= sizeof(dir))
+    return 0;
+  strcpy(dir, mount);
+  strcat(dir, rel);
+
+  while (1) {
+    c = psnip_cpu_cgroup_quota(dir, v2);
+    if (c > 0 && (limit == 0 || c < limit))
+      limit = c;
+
+    p = strrchr(dir, '/');
+    if (p == NULL || (size_t) (p - dir) < mount_len)
+      break;
+    *p = '\0';
+  }
+
+  return limit;
+}
+#endif
+
+static void
+psnip_cpu_available_init(void) {
+  int c = psnip_cpu_count();
+#if defined(__linux__)
+  int n;
+
+  n = psnip_cpu_affinity_count();
+  if (n > 0 && (c <= 0 || n < c))
+    c = n;
+
+  n = psnip_cpu_cgroup_count();
+  if (n > 0 && (c <= 0 || n < c))
+    c = n;
+#endif
+
+  psnip_cpu_available = (c > 0) ? c : -1;
+}
+
+int
+psnip_cpu_count_available (void) {
+#if defined(_MSC_VER)
+#pragma warning(push)
+#pragma warning(disable:4152)
+#endif
+  psnip_once_call (&psnip_cpu_available_once, psnip_cpu_available_init);
+#if defined(_MSC_VER)
+#pragma warning(pop)
+#endif
+
+  return psnip_cpu_available;
+}
+
+/* Affinity
+ *
+ * All of these return -1 on failure (including if the platform
+ * doesn't support them), or if any CPU number is invalid. */
+
+#if defined(PSNIP_CPU_ARCH_X86) || defined(PSNIP_CPU_ARCH_X86_64)
+#  if defined(__linux__) && defined(__GNUC__)
+#    define PSNIP_CPU__IMPL_RDPID
+#  endif
+#endif
+
+#if defined(PSNIP_CPU__IMPL_RDPID)
+static int psnip_cpu_current_rdpid = 0;
+static psnip_once psnip_cpu_current_once = PSNIP_ONCE_INIT;
+
+static void
+psnip_cpu_current_init(void) {
+  psnip_cpu_current_rdpid = psnip_cpu_feature_check(PSNIP_CPU_FEATURE_X86_RDPID);
+}
+#endif
+
+#if defined(__linux__) && defined(CPU_COUNT_S)
+/* Allocates a set containing the listed CPUs. */
+static cpu_set_t*
+psnip_cpu_set_from_list(const int* cpus, int count, size_t* size) {
+  cpu_set_t* set;
+  int i, n = 0;
+
+  if (count <= 0)
+    return NULL;
+  for (i = 0 ; i < count ; i++) {
+    if (cpus[i] < 0)
+      return NULL;
+    if (cpus[i] >= n)
+      n = cpus[i] + 1;
+  }
+
+  set = CPU_ALLOC(n);
+  if (set == NULL)
+    return NULL;
+  *size = CPU_ALLOC_SIZE(n);
+  CPU_ZERO_S(*size, set);
+  for (i = 0 ; i < count ; i++)
+    CPU_SET_S((size_t) cpus[i], *size, set);
+
+  return set;
+}
+#elif defined(_WIN32)
+static DWORD_PTR
+psnip_cpu_mask_from_list(const int* cpus, int count) {
+  DWORD_PTR mask = 0;
+  int i;
+
+  for (i = 0 ; i < count ; i++) {
+    if (cpus[i] < 0 || cpus[i] >= (int) (sizeof(DWORD_PTR) * 8))
+      return 0;
+    mask |= ((DWORD_PTR) 1) << cpus[i];
+  }
+
+  return mask;
+}
+#endif
+
+int
+psnip_cpu_pin (int cpu) {
+  return psnip_cpu_pin_set(&cpu, 1);
+}
+
+int
+psnip_cpu_pin_set (const int* cpus, int count) {
+#if defined(__linux__) && defined(CPU_COUNT_S)
+  cpu_set_t* set;
+  size_t size;
+  int r;
+
+  set = psnip_cpu_set_from_list(cpus, count, &size);
+  if (set == NULL)
+    return -1;
+  r = sched_setaffinity(0, size, set);
+  CPU_FREE(set);
+
+  return (r == 0) ? 0 : -1;
+#elif defined(_WIN32)
+  const DWORD_PTR mask = psnip_cpu_mask_from_list(cpus, count);
+
+  if (mask == 0)
+    return -1;
+
+  return (SetThreadAffinityMask(GetCurrentThread(), mask) != 0) ? 0 : -1;
+#else
+  (void) cpus;
+  (void) count;
+
+  return -1;
+#endif
+}
+
+#if defined(PSNIP_ENABLE_PTHREADS)
+int
+psnip_cpu_thread_pin_set (pthread_t thread, const int* cpus, int count) {
+#if defined(__linux__) && defined(CPU_COUNT_S)
+  cpu_set_t* set;
+  size_t size;
+  int r;
+
+  set = psnip_cpu_set_from_list(cpus, count, &size);
+  if (set == NULL)
+    return -1;
+  r = pthread_setaffinity_np(thread, size, set);
+  CPU_FREE(set);
+
+  return (r == 0) ? 0 : -1;
+#else
+  (void) thread;
+  (void) cpus;
+  (void) count;
+
+  return -1;
+#endif
+}
+#endif
+
+/* RDPID reads IA32_TSC_AUX, where Linux stores (node << 12) | cpu.
+ * RDTSCP reads the same register but is much slower (it waits for
+ * earlier instructions, and hypervisors often trap it), so without
+ * RDPID we use sched_getcpu, which glibc answers from the vDSO or
+ * rseq. */
+int
+psnip_cpu_current (void) {
+#if defined(PSNIP_CPU__IMPL_RDPID)
+  unsigned long aux;
+
+#if defined(_MSC_VER)
+#pragma warning(push)
+#pragma warning(disable:4152)
+#endif
+  psnip_once_call (&psnip_cpu_current_once, psnip_cpu_current_init);
+#if defined(_MSC_VER)
+#pragma warning(pop)
+#endif
+
+  if (psnip_cpu_current_rdpid) {
+    __asm__ __volatile__ ("rdpid %0" : "=r" (aux));
+    return (int) (aux & 0xfff);
+  }
+#endif
+
+#if defined(__linux__)
+  return sched_getcpu();
+#elif defined(_WIN32)
+  return (int) GetCurrentProcessorNumber();
+#else
+  return -1;
+#endif
+}
+
+int
+psnip_cpu_allowed (int* cpus, int max) {
+  int i, n = 0;
+#if defined(__linux__) && defined(CPU_COUNT_S)
+  cpu_set_t* set;
+  size_t size;
+  int max_cpus;
+
+  set = psnip_cpu_affinity_get(&size, &max_cpus);
+  if (set == NULL)
+    return -1;
+  for (i = 0 ; i < max_cpus ; i++) {
+    if (CPU_ISSET_S((size_t) i, size, set)) {
+      if (n < max)
+	cpus[n] = i;
+      n++;
+    }
+  }
+  CPU_FREE(set);
+#elif defined(_WIN32)
+  DWORD_PTR process_mask, system_mask;
+
+  if (!GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask))
+    return -1;
+  for (i = 0 ; process_mask != 0 ; i++, process_mask >>= 1) {
+    if (process_mask & 1) {
+      if (n < max)
+	cpus[n] = i;
+      n++;
+    }
+  }
+#else
+  /* No affinity support, so every CPU is allowed. */
+  n = psnip_cpu_count();
+  if (n < 0)
+    return -1;
+  for (i = 0 ; i < n && i < max ; i++)
+    cpus[i] = i;
+#endif
+
+  return n;
+}
+
+/* Caches
+ *
+ * On Linux we prefer sysfs since it knows exactly which CPUs share
+ * each cache; otherwise we use CPUID (leaf 4 on Intel, 0x8000001D on
+ * AMD) on x86, and finally sysconf where the C library provides cache
+ * information (glibc does). */
+
+#define PSNIP_CPU__MAX_CACHES 16
+
+static struct PSnipCPUCache psnip_cpu_caches[PSNIP_CPU__MAX_CACHES];
+static int psnip_cpu_caches_count = 0;
+static psnip_once psnip_cpu_cache_once = PSNIP_ONCE_INIT;
+
+static void
+psnip_cpu_cache_add(int level, enum PSnipCPUCacheType type, size_t size, int line_size, int associativity, int shared_by) {
+  struct PSnipCPUCache* cache;
+
+  if (psnip_cpu_caches_count >= PSNIP_CPU__MAX_CACHES || level < 1 || size == 0)
+    return;
+
+  cache = &(psnip_cpu_caches[psnip_cpu_caches_count++]);
+  cache->level = level;
+  cache->type = type;
+  cache->size = size;
+  cache->line_size = line_size;
+  cache->associativity = associativity;
+  cache->shared_by = shared_by;
+}
+
+#if defined(__linux__)
+static void
+psnip_cpu_cache_init_sysfs(void) {
+  char path[128], buf[256];
+  char* end;
+  int index, level, line_size, associativity, shared_by;
+  enum PSnipCPUCacheType type;
+  size_t size;
+
+  for (index = 0 ; index < PSNIP_CPU__MAX_CACHES ; index++) {
+#define PSNIP_CPU__SYSFS_READ(attr) \
+    (sprintf(path, "/sys/devices/system/cpu/cpu0/cache/index%d/" attr, index), \
+     psnip_cpu_sysfs_read(path, buf, sizeof(buf)))
+
+    if (!PSNIP_CPU__SYSFS_READ("level"))
+      break;
+    level = atoi(buf);
+
+    if (!PSNIP_CPU__SYSFS_READ("type"))
+      continue;
+    if (strcmp(buf, "Data") == 0)
+      type = PSNIP_CPU_CACHE_TYPE_DATA;
+    else if (strcmp(buf, "Instruction") == 0)
+      type = PSNIP_CPU_CACHE_TYPE_INSTRUCTION;
+    else if (strcmp(buf, "Unified") == 0)
+      type = PSNIP_CPU_CACHE_TYPE_UNIFIED;
+    else
+      continue;
+
+    if (!PSNIP_CPU__SYSFS_READ("size"))
+      continue;
+    size = (size_t) strtoul(buf, &end, 10);
+    switch (*end) {
+      case 'K': size *= 1024; break;
+      case 'M': size *= 1024 * 1024; break;
+      case 'G': size *= 1024 * 1024 * 1024; break;
+    }
+
+    line_size = PSNIP_CPU__SYSFS_READ("coherency_line_size") ? atoi(buf) : 0;
+    associativity = PSNIP_CPU__SYSFS_READ("ways_of_associativity") ? atoi(buf) : 0;
+    shared_by = PSNIP_CPU__SYSFS_READ("shared_cpu_list") ? psnip_cpu_list_count(buf) : 0;
+
+#undef PSNIP_CPU__SYSFS_READ
+
+    psnip_cpu_cache_add(level, type, size, line_size, associativity, shared_by);
+  }
+}
+#endif
+
+#if defined(PSNIP_CPU_ARCH_X86) || defined(PSNIP_CPU_ARCH_X86_64)
+static void
+psnip_cpu_cache_init_cpuid(void) {
+  unsigned int regs[4];
+  unsigned int leaf = 0, type, ways, partitions, line_size, sets;
+  size_t size;
+  int i;
+
+  psnip_cpu_getid(0, (int*) regs);
+  if (regs[0] >= 4) {
+    psnip_cpu_getid_count(4, 0, (int*) regs);
+    if ((regs[0] & 0x1f) != 0)
+      leaf = 4;
+  }
+
+  if (leaf == 0) {
+    /* AMD; requires the topology extensions (CPUID 0x80000001 ECX bit
+     * 22). */
+    psnip_cpu_getid((int) 0x80000000U, (int*) regs);
+    if (regs[0] >= 0x8000001DU) {
+      psnip_cpu_getid((int) 0x80000001U, (int*) regs);
+      if ((regs[2] >> 22) & 1)
+	leaf = 0x8000001DU;
+    }
+  }
+
+  if (leaf == 0)
+    return;
+
+  for (i = 0 ; i < PSNIP_CPU__MAX_CACHES ; i++) {
+    psnip_cpu_getid_count((int) leaf, i, (int*) regs);
+
+    type = regs[0] & 0x1f;
+    if (type == PSNIP_CPU_CACHE_TYPE_NULL)
+      break;
+    if (type > PSNIP_CPU_CACHE_TYPE_UNIFIED)
+      continue;
+
+    ways = ((regs[1] >> 22) & 0x3ff) + 1;
+    partitions = ((regs[1] >> 12) & 0x3ff) + 1;
+    line_size = (regs[1] & 0xfff) + 1;
+    sets = regs[2] + 1;
+    size = (size_t) ways * partitions * line_size * sets;
+
+    /* For sharing, CPUID only tells us the maximum number of logical
+     * processor IDs which may share the cache. */
+    psnip_cpu_cache_add((int) ((regs[0] >> 5) & 7), (enum PSnipCPUCacheType) type, size, (int) line_size,
+			((regs[0] >> 9) & 1) ? (int) (size / line_size) : (int) ways,
+			(int) ((regs[0] >> 14) & 0xfff) + 1);
+  }
+}
+#endif
+
+#if defined(_SC_LEVEL1_DCACHE_SIZE)
+static void
+psnip_cpu_cache_add_sysconf(int level, enum PSnipCPUCacheType type, int size_name, int line_size_name, int associativity_name) {
+  const long size = sysconf(size_name);
+  const long line_size = sysconf(line_size_name);
+  const long associativity = sysconf(associativity_name);
+
+  if (size > 0)
+    psnip_cpu_cache_add(level, type, (size_t) size,
+			line_size > 0 ? (int) line_size : 0,
+			associativity > 0 ? (int) associativity : 0,
+			0);
+}
+
+static void
+psnip_cpu_cache_init_sysconf(void) {
+  psnip_cpu_cache_add_sysconf(1, PSNIP_CPU_CACHE_TYPE_DATA,
+			      _SC_LEVEL1_DCACHE_SIZE, _SC_LEVEL1_DCACHE_LINESIZE, _SC_LEVEL1_DCACHE_ASSOC);
+  psnip_cpu_cache_add_sysconf(1, PSNIP_CPU_CACHE_TYPE_INSTRUCTION,
+			      _SC_LEVEL1_ICACHE_SIZE, _SC_LEVEL1_ICACHE_LINESIZE, _SC_LEVEL1_ICACHE_ASSOC);
+  psnip_cpu_cache_add_sysconf(2, PSNIP_CPU_CACHE_TYPE_UNIFIED,
+			      _SC_LEVEL2_CACHE_SIZE, _SC_LEVEL2_CACHE_LINESIZE, _SC_LEVEL2_CACHE_ASSOC);
+  psnip_cpu_cache_add_sysconf(3, PSNIP_CPU_CACHE_TYPE_UNIFIED,
+			      _SC_LEVEL3_CACHE_SIZE, _SC_LEVEL3_CACHE_LINESIZE, _SC_LEVEL3_CACHE_ASSOC);
+  psnip_cpu_cache_add_sysconf(4, PSNIP_CPU_CACHE_TYPE_UNIFIED,
+			      _SC_LEVEL4_CACHE_SIZE, _SC_LEVEL4_CACHE_LINESIZE, _SC_LEVEL4_CACHE_ASSOC);
+}
+#endif
+
+static void
+psnip_cpu_cache_init(void) {
+  struct PSnipCPUCache tmp;
+  int i, j;
+
+#if defined(__linux__)
+  psnip_cpu_cache_init_sysfs();
+#endif
+#if defined(PSNIP_CPU_ARCH_X86) || defined(PSNIP_CPU_ARCH_X86_64)
+  if (psnip_cpu_caches_count == 0)
+    psnip_cpu_cache_init_cpuid();
+#endif
+#if defined(_SC_LEVEL1_DCACHE_SIZE)
+  if (psnip_cpu_caches_count == 0)
+    psnip_cpu_cache_init_sysconf();
+#endif
+
+  /* Sort by level, then type (data, instruction, unified). */
+  for (i = 1 ; i < psnip_cpu_caches_count ; i++) {
+    tmp = psnip_cpu_caches[i];
+    for (j = i ; j > 0 &&
+	   (psnip_cpu_caches[j - 1].level > tmp.level ||
+	    (psnip_cpu_caches[j - 1].level == tmp.level && psnip_cpu_caches[j - 1].type > tmp.type)) ; j--)
+      psnip_cpu_caches[j] = psnip_cpu_caches[j - 1];
+    psnip_cpu_caches[j] = tmp;
+  }
+}
+
+int
+psnip_cpu_cache_count (void) {
+#if defined(_MSC_VER)
+#pragma warning(push)
+#pragma warning(disable:4152)
+#endif
+  psnip_once_call (&psnip_cpu_cache_once, psnip_cpu_cache_init);
+#if defined(_MSC_VER)
+#pragma warning(pop)
+#endif
+
+  return psnip_cpu_caches_count;
+}
+
+const struct PSnipCPUCache*
+psnip_cpu_cache_get (int index) {
+  if (index < 0 || index >= psnip_cpu_cache_count())
+    return NULL;
+
+  return &(psnip_cpu_caches[index]);
+}
+
+/* A data or instruction request is satisfied by a unified cache if
+ * there is no separate one; PSNIP_CPU_CACHE_TYPE_NULL matches any
+ * cache which holds data. */
+const struct PSnipCPUCache*
+psnip_cpu_cache_find (int level, enum PSnipCPUCacheType type) {
+  const int count = psnip_cpu_cache_count();
+  int i;
+
+  for (i = 0 ; i < count ; i++)
+    if (psnip_cpu_caches[i].level == level && psnip_cpu_caches[i].type == type)
+      return &(psnip_cpu_caches[i]);
+
+  for (i = 0 ; i < count ; i++)
+    if (psnip_cpu_caches[i].level == level && psnip_cpu_caches[i].type != PSNIP_CPU_CACHE_TYPE_INSTRUCTION &&
+	(type != PSNIP_CPU_CACHE_TYPE_INSTRUCTION || psnip_cpu_caches[i].type == PSNIP_CPU_CACHE_TYPE_UNIFIED))
+      return &(psnip_cpu_caches[i]);
+
+  return NULL;
+}
+
+/* Topology
+ *
+ * On Linux all of this comes from sysfs.  Elsewhere (or if sysfs isn't
+ * available) we use CPUID leaf 0x1F or 0xB on x86 to find out how many
+ * threads share a core and how many logical CPUs are in a package,
+ * and assume siblings are numbered consecutively, which is what
+ * Windows does.  Failing that, we report one package with one thread
+ * per core.  Without sysfs there is a single NUMA node. */
+
+static struct PSnipCPUTopology* psnip_cpu_topology = NULL;
+static int psnip_cpu_topology_n = 0;
+static psnip_once psnip_cpu_topology_once = PSNIP_ONCE_INIT;
+
+/* 10 is the ACPI SLIT distance from a node to itself. */
+static int psnip_cpu_node_default[1] = { 0 };
+static int psnip_cpu_node_default_distance[1] = { 10 };
+static int* psnip_cpu_nodes = psnip_cpu_node_default;
+static int* psnip_cpu_node_distances = psnip_cpu_node_default_distance;
+static int psnip_cpu_nodes_n = 1;
+
+/* Entries are sorted by CPU number. */
+static struct PSnipCPUTopology*
+psnip_cpu_topology_search(int cpu) {
+  int low = 0, high = psnip_cpu_topology_n, mid;
+
+  while (low < high) {
+    mid = low + ((high - low) / 2);
+    if (psnip_cpu_topology[mid].cpu < cpu)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  if (low < psnip_cpu_topology_n && psnip_cpu_topology[low].cpu == cpu)
+    return &(psnip_cpu_topology[low]);
+
+  return NULL;
+}
+
+#if defined(__linux__)
+static int
+psnip_cpu_topology_init_sysfs(void) {
+  char path[128], buf[4096];
+  const char* list;
+  char* end;
+  struct PSnipCPUTopology* topo;
+  unsigned long first, last, cpu;
+  int i, j, n;
+
+  if (!psnip_cpu_sysfs_read("/sys/devices/system/cpu/online", buf, sizeof(buf)))
+    return 0;
+  n = psnip_cpu_list_count(buf);
+  if (n <= 0)
+    return 0;
+
+  psnip_cpu_topology = (struct PSnipCPUTopology*) calloc((size_t) n, sizeof(struct PSnipCPUTopology));
+  if (psnip_cpu_topology == NULL)
+    return 0;
+
+  list = buf;
+  i = 0;
+  while (psnip_cpu_list_next(&list, &first, &last))
+    for (cpu = first ; cpu <= last && i < n ; cpu++)
+      psnip_cpu_topology[i++].cpu = (int) cpu;
+  psnip_cpu_topology_n = i;
+
+  for (i = 0 ; i < psnip_cpu_topology_n ; i++) {
+    topo = &(psnip_cpu_topology[i]);
+
+#define PSNIP_CPU__SYSFS_READ(attr) \
+    (sprintf(path, "/sys/devices/system/cpu/cpu%d/topology/" attr, topo->cpu), \
+     psnip_cpu_sysfs_read(path, buf, sizeof(buf)))
+
+    topo->package = PSNIP_CPU__SYSFS_READ("physical_package_id") ? atoi(buf) : 0;
+    if (topo->package < 0)
+      topo->package = 0;
+    topo->core = PSNIP_CPU__SYSFS_READ("core_id") ? atoi(buf) : topo->cpu;
+    topo->thread = PSNIP_CPU__SYSFS_READ("thread_siblings_list") ? psnip_cpu_list_rank(buf, (unsigned long) topo->cpu) : 0;
+
+#undef PSNIP_CPU__SYSFS_READ
+  }
+
+  /* NUMA nodes.  Each node's distance file lists its distance to
+   * every online node, in order. */
+  if (!psnip_cpu_sysfs_read("/sys/devices/system/node/online", buf, sizeof(buf)))
+    return 1;
+  n = psnip_cpu_list_count(buf);
+  if (n <= 1)
+    return 1;
+
+  psnip_cpu_nodes = (int*) malloc(sizeof(int) * (size_t) n);
+  psnip_cpu_node_distances = (int*) malloc(sizeof(int) * (size_t) n * (size_t) n);
+  if (psnip_cpu_nodes == NULL || psnip_cpu_node_distances == NULL) {
+    free(psnip_cpu_nodes);
+    free(psnip_cpu_node_distances);
+    psnip_cpu_nodes = psnip_cpu_node_default;
+    psnip_cpu_node_distances = psnip_cpu_node_default_distance;
+    return 1;
+  }
+
+  list = buf;
+  i = 0;
+  while (psnip_cpu_list_next(&list, &first, &last))
+    for (cpu = first ; cpu <= last && i < n ; cpu++)
+      psnip_cpu_nodes[i++] = (int) cpu;
+  psnip_cpu_nodes_n = i;
+
+  for (i = 0 ; i < psnip_cpu_nodes_n ; i++) {
+    sprintf(path, "/sys/devices/system/node/node%d/cpulist", psnip_cpu_nodes[i]);
+    if (psnip_cpu_sysfs_read(path, buf, sizeof(buf))) {
+      list = buf;
+      while (psnip_cpu_list_next(&list, &first, &last))
+	for (cpu = first ; cpu <= last ; cpu++)
+	  if ((topo = psnip_cpu_topology_search((int) cpu)) != NULL)
+	    topo->node = psnip_cpu_nodes[i];
+    }
+
+    sprintf(path, "/sys/devices/system/node/node%d/distance", psnip_cpu_nodes[i]);
+    list = psnip_cpu_sysfs_read(path, buf, sizeof(buf)) ? buf : "";
+    for (j = 0 ; j < psnip_cpu_nodes_n ; j++) {
+      psnip_cpu_node_distances[(i * psnip_cpu_nodes_n) + j] = (int) strtol(list, &end, 10);
+      if (end == list)
+	psnip_cpu_node_distances[(i * psnip_cpu_nodes_n) + j] = (i == j) ? 10 : 20;
+      list = end;
+    }
+  }
+
+  return 1;
+}
+#endif
+
+#if defined(PSNIP_CPU_ARCH_X86) || defined(PSNIP_CPU_ARCH_X86_64)
+static void
+psnip_cpu_topology_init_cpuid(int* threads_per_core, int* cpus_per_package) {
+  unsigned int regs[4];
+  /* 0x1F (V2 extended topology) can describe more levels than 0xB, but
+   * the levels we care about are the same. */
+  static const unsigned int leaves[] = { 0x1F, 0xB };
+  unsigned int max_leaf, leaf, level_type, count;
+  int i, level;
+
+  psnip_cpu_getid(0, (int*) regs);
+  max_leaf = regs[0];
+
+  for (i = 0 ; i < (int) (sizeof(leaves) / sizeof(leaves[0])) ; i++) {
+    leaf = leaves[i];
+    if (max_leaf < leaf)
+      continue;
+
+    for (level = 0 ; level < 8 ; level++) {
+      psnip_cpu_getid_count((int) leaf, level, (int*) regs);
+      level_type = (regs[2] >> 8) & 0xff;
+      count = regs[1] & 0xffff;
+      if (level_type == 0)
+	break;
+      if (count == 0)
+	continue;
+
+      if (level_type == 1)
+	*threads_per_core = (int) count;
+      *cpus_per_package = (int) count;
+    }
+
+    if (level > 0)
+      return;
+  }
+}
+#endif
+
+static void
+psnip_cpu_topology_init_generic(void) {
+  struct PSnipCPUTopology* topo;
+  int i, n, threads_per_core, cpus_per_package;
+
+  n = psnip_cpu_count();
+  if (n < 1)
+    n = 1;
+  threads_per_core = 1;
+  cpus_per_package = n;
+#if defined(PSNIP_CPU_ARCH_X86) || defined(PSNIP_CPU_ARCH_X86_64)
+  psnip_cpu_topology_init_cpuid(&threads_per_core, &cpus_per_package);
+#endif
+
+  psnip_cpu_topology = (struct PSnipCPUTopology*) calloc((size_t) n, sizeof(struct PSnipCPUTopology));
+  if (psnip_cpu_topology == NULL)
+    return;
+
+  for (i = 0 ; i < n ; i++) {
+    topo = &(psnip_cpu_topology[i]);
+    topo->cpu = i;
+    topo->package = i / cpus_per_package;
+    topo->core = (i % cpus_per_package) / threads_per_core;
+    topo->thread = i % threads_per_core;
+  }
+  psnip_cpu_topology_n = n;
+}
+
+/* Core types
+ *
+ * On Linux, cpu_capacity in sysfs gives the relative performance of
+ * each CPU where the kernel knows it (mostly ARM, from the device
+ * tree).  On hybrid x86 CPUs the perf PMU devices list the P-cores
+ * (cpu_core) and E-cores (cpu_atom); without those we run CPUID leaf
+ * 0x1A on each CPU, which means briefly pinning the calling thread to
+ * it.  ACPI CPPC's highest_perf provides a capacity on x86. */
+
+#if defined(__linux__)
+static void
+psnip_cpu_core_type_mark_sysfs(const char* path, enum PSnipCPUCoreType type) {
+  char buf[4096];
+  const char* list;
+  unsigned long first, last, cpu;
+  struct PSnipCPUTopology* topo;
+
+  if (!psnip_cpu_sysfs_read(path, buf, sizeof(buf)))
+    return;
+
+  list = buf;
+  while (psnip_cpu_list_next(&list, &first, &last))
+    for (cpu = first ; cpu <= last ; cpu++)
+      if ((topo = psnip_cpu_topology_search((int) cpu)) != NULL)
+	topo->core_type = type;
+}
+
+static void
+psnip_cpu_core_type_init_sysfs(int hybrid) {
+  char path[128], buf[64];
+  struct PSnipCPUTopology* topo;
+  int i;
+
+  for (i = 0 ; i < psnip_cpu_topology_n ; i++) {
+    topo = &(psnip_cpu_topology[i]);
+    sprintf(path, "/sys/devices/system/cpu/cpu%d/cpu_capacity", topo->cpu);
+    if (psnip_cpu_sysfs_read(path, buf, sizeof(buf)))
+      topo->capacity = atoi(buf);
+  }
+
+  if (!hybrid)
+    return;
+
+  psnip_cpu_core_type_mark_sysfs("/sys/devices/cpu_core/cpus", PSNIP_CPU_CORE_TYPE_PERFORMANCE);
+  psnip_cpu_core_type_mark_sysfs("/sys/devices/cpu_atom/cpus", PSNIP_CPU_CORE_TYPE_EFFICIENCY);
+
+  for (i = 0 ; i < psnip_cpu_topology_n ; i++) {
+    topo = &(psnip_cpu_topology[i]);
+    if (topo->capacity != 0)
+      continue;
+    sprintf(path, "/sys/devices/system/cpu/cpu%d/acpi_cppc/highest_perf", topo->cpu);
+    if (psnip_cpu_sysfs_read(path, buf, sizeof(buf)))
+      topo->capacity = atoi(buf);
+  }
+}
+#endif
+
+#if defined(PSNIP_CPU_ARCH_X86) || defined(PSNIP_CPU_ARCH_X86_64)
+static void
+psnip_cpu_core_type_init_cpuid(void) {
+  struct PSnipCPUTopology* topo;
+  unsigned int regs[4];
+  int* allowed;
+  int i, n;
+
+  psnip_cpu_getid(0, (int*) regs);
+  if (regs[0] < 0x1A)
+    return;
+
+  n = psnip_cpu_allowed(NULL, 0);
+  if (n <= 0)
+    return;
+  allowed = (int*) malloc(sizeof(int) * (size_t) n);
+  if (allowed == NULL)
+    return;
+  psnip_cpu_allowed(allowed, n);
+
+  for (i = 0 ; i < psnip_cpu_topology_n ; i++) {
+    topo = &(psnip_cpu_topology[i]);
+    if (topo->core_type != PSNIP_CPU_CORE_TYPE_UNKNOWN || psnip_cpu_pin(topo->cpu) != 0)
+      continue;
+
+    psnip_cpu_getid_count(0x1A, 0, (int*) regs);
+    switch (regs[0] >> 24) {
+      case 0x40: /* Core */
+	topo->core_type = PSNIP_CPU_CORE_TYPE_PERFORMANCE;
+	break;
+      case 0x20: /* Atom */
+	topo->core_type = PSNIP_CPU_CORE_TYPE_EFFICIENCY;
+	break;
+    }
+  }
+
+  psnip_cpu_pin_set(allowed, n);
+  free(allowed);
+}
+#endif
+
+static void
+psnip_cpu_core_type_init(void) {
+  struct PSnipCPUTopology* topo;
+  int i, hybrid = 0, max_capacity = 0, min_capacity = 0;
+
+#if defined(PSNIP_CPU_ARCH_X86) || defined(PSNIP_CPU_ARCH_X86_64)
+  hybrid = psnip_cpu_feature_check(PSNIP_CPU_FEATURE_X86_HYBRID);
+#endif
+
+#if defined(__linux__)
+  psnip_cpu_core_type_init_sysfs(hybrid);
+#endif
+#if defined(PSNIP_CPU_ARCH_X86) || defined(PSNIP_CPU_ARCH_X86_64)
+  if (hybrid) {
+    for (i = 0 ; i < psnip_cpu_topology_n && psnip_cpu_topology[i].core_type != PSNIP_CPU_CORE_TYPE_UNKNOWN ; i++) { }
+    if (i < psnip_cpu_topology_n)
+      psnip_cpu_core_type_init_cpuid();
+  }
+#endif
+
+  /* Scale capacities so the fastest CPU is 1024, like Linux does. */
+  for (i = 0 ; i < psnip_cpu_topology_n ; i++) {
+    topo = &(psnip_cpu_topology[i]);
+    if (topo->capacity > max_capacity)
+      max_capacity = topo->capacity;
+    if (topo->capacity > 0 && (min_capacity == 0 || topo->capacity < min_capacity))
+      min_capacity = topo->capacity;
+  }
+  for (i = 0 ; i < psnip_cpu_topology_n ; i++) {
+    topo = &(psnip_cpu_topology[i]);
+    if (max_capacity > 0 && topo->capacity > 0)
+      topo->capacity = (int) (((long) topo->capacity * 1024 + (max_capacity / 2)) / max_capacity);
+
+    /* Anything slower than the fastest CPUs is an efficiency core,
+     * unless we already know better. */
+    if (topo->core_type == PSNIP_CPU_CORE_TYPE_UNKNOWN && topo->capacity > 0)
+      topo->core_type = (topo->capacity == 1024) ? PSNIP_CPU_CORE_TYPE_PERFORMANCE : PSNIP_CPU_CORE_TYPE_EFFICIENCY;
+  }
+
+#if defined(PSNIP_CPU_ARCH_X86) || defined(PSNIP_CPU_ARCH_X86_64)
+  /* Without the hybrid flag, every core is the same. */
+  if (!hybrid) {
+    for (i = 0 ; i < psnip_cpu_topology_n ; i++) {
+      topo = &(psnip_cpu_topology[i]);
+      topo->core_type = PSNIP_CPU_CORE_TYPE_PERFORMANCE;
+      if (topo->capacity == 0 || min_capacity == max_capacity)
+	topo->capacity = 1024;
+    }
+  }
+#endif
+}
+
+static void
+psnip_cpu_topology_init(void) {
+#if defined(__linux__)
+  if (!psnip_cpu_topology_init_sysfs())
+#endif
+    psnip_cpu_topology_init_generic();
+
+  psnip_cpu_core_type_init();
+}
+
+int
+psnip_cpu_topology_count (void) {
+#if defined(_MSC_VER)
+#pragma warning(push)
+#pragma warning(disable:4152)
+#endif
+  psnip_once_call (&psnip_cpu_topology_once, psnip_cpu_topology_init);
+#if defined(_MSC_VER)
+#pragma warning(pop)
+#endif
+
+  return psnip_cpu_topology_n;
+}
+
+const struct PSnipCPUTopology*
+psnip_cpu_topology_get (int index) {
+  if (index < 0 || index >= psnip_cpu_topology_count())
+    return NULL;
+
+  return &(psnip_cpu_topology[index]);
+}
+
+const struct PSnipCPUTopology*
+psnip_cpu_topology_find (int cpu) {
+  psnip_cpu_topology_count();
+
+  return psnip_cpu_topology_search(cpu);
+}
+
+int
+psnip_cpu_node_count (void) {
+  psnip_cpu_topology_count();
+
+  return psnip_cpu_nodes_n;
+}
+
+int
+psnip_cpu_node_id (int index) {
+  if (index < 0 || index >= psnip_cpu_node_count())
+    return -1;
+
+  return psnip_cpu_nodes[index];
+}
+
+int
+psnip_cpu_node_distance (int from, int to) {
+  const int count = psnip_cpu_node_count();
+  int i, j;
+
+  for (i = 0 ; i < count && psnip_cpu_nodes[i] != from ; i++) { }
+  for (j = 0 ; j < count && psnip_cpu_nodes[j] != to ; j++) { }
+  if (i == count || j == count)
+    return -1;
+
+  return psnip_cpu_node_distances[(i * count) + j];
+}
+
+/* Time stamp counter
+ *
+ * On x86 CPUID leaf 0x15 gives the TSC frequency as a ratio of the
+ * crystal clock.  It isn't available everywhere (hypervisors often
+ * hide it, and older CPUs don't report the crystal frequency), so
+ * otherwise we measure the TSC against the monotonic clock.  If even
+ * that fails, the base frequency from leaf 0x16 is close to the TSC
+ * frequency on CPUs which have it.  On AArch64 the generic timer
+ * frequency is in CNTFRQ_EL0. */
+
+static psnip_once psnip_cpu_tsc_once = PSNIP_ONCE_INIT;
+static double psnip_cpu_tsc_hz = 0.0;
+
+#if defined(PSNIP_CPU_ARCH_X86) || defined(PSNIP_CPU_ARCH_X86_64)
+static psnip_uint64_t
+psnip_cpu_rdtsc(void) {
+#if defined(_MSC_VER)
+  return (psnip_uint64_t) __rdtsc();
+#else
+  psnip_uint32_t lo, hi;
+  __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+  return (((psnip_uint64_t) hi) << 32) | lo;
+#endif
+}
+
+static double
+psnip_cpu_tsc_calibrate(void) {
+  struct PsnipClockTimespec start, now;
+  psnip_uint64_t tsc_start, tsc_now, elapsed;
+
+  if (psnip_clock_monotonic_get_time(&start) != 0)
+    return 0.0;
+  tsc_start = psnip_cpu_rdtsc();
+
+  /* 10 ms is long enough for the cost of reading the clock to be lost
+   * in the noise (a few parts per million). */
+  do {
+    if (psnip_clock_monotonic_get_time(&now) != 0)
+      return 0.0;
+    tsc_now = psnip_cpu_rdtsc();
+    elapsed = ((now.seconds - start.seconds) * PSNIP_CLOCK_NSEC_PER_SEC) + now.nanoseconds - start.nanoseconds;
+  } while (elapsed < 10000000);
+
+  return ((double) (tsc_now - tsc_start) * 1e9) / (double) elapsed;
+}
+#endif
+
+static void
+psnip_cpu_tsc_init(void) {
+#if defined(PSNIP_CPU_ARCH_X86) || defined(PSNIP_CPU_ARCH_X86_64)
+  unsigned int regs[4];
+  unsigned int max_leaf;
+
+  if (!psnip_cpu_feature_check(PSNIP_CPU_FEATURE_X86_INVARIANT_TSC))
+    return;
+
+  psnip_cpu_getid(0, (int*) regs);
+  max_leaf = regs[0];
+
+  if (max_leaf >= 0x15) {
+    psnip_cpu_getid(0x15, (int*) regs);
+    if (regs[0] != 0 && regs[1] != 0 && regs[2] != 0) {
+      psnip_cpu_tsc_hz = ((double) regs[2] * regs[1]) / regs[0];
+      return;
+    }
+  }
+
+  psnip_cpu_tsc_hz = psnip_cpu_tsc_calibrate();
+
+  if (psnip_cpu_tsc_hz == 0.0 && max_leaf >= 0x16) {
+    psnip_cpu_getid(0x16, (int*) regs);
+    psnip_cpu_tsc_hz = (double) (regs[0] & 0xffff) * 1e6;
+  }
+#elif defined(PSNIP_CPU_ARCH_ARM64) && (defined(__GNUC__) || defined(__clang__))
+  unsigned long freq;
+  __asm__ __volatile__ ("mrs %0, cntfrq_el0" : "=r" (freq));
+  psnip_cpu_tsc_hz = (double) freq;
+#endif
+}
+
+double
+psnip_cpu_tsc_frequency (void) {
+#if defined(_MSC_VER)
+#pragma warning(push)
+#pragma warning(disable:4152)
+#endif
+  psnip_once_call (&psnip_cpu_tsc_once, psnip_cpu_tsc_init);
+#if defined(_MSC_VER)
+#pragma warning(pop)
+#endif
+
+  return psnip_cpu_tsc_hz;
+}
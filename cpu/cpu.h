@@ -21,6 +21,33 @@
 #  define PSNIP_CPU_ARCH_ARM64
 #endif
 
+#if !defined(PSNIP_CPU_STATIC_INLINE)
+#  if defined(__GNUC__)
+#    define PSNIP_CPU__COMPILER_ATTRIBUTES __attribute__((__unused__))
+#  else
+#    define PSNIP_CPU__COMPILER_ATTRIBUTES
+#  endif
+
+#  if defined(HEDLEY_INLINE)
+#    define PSNIP_CPU__INLINE HEDLEY_INLINE
+#  elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 199901L
+#    define PSNIP_CPU__INLINE inline
+#  elif defined(__GNUC_STDC_INLINE__)
+#    define PSNIP_CPU__INLINE __inline__
+#  elif defined(_MSC_VER) && _MSC_VER >= 1200
+#    define PSNIP_CPU__INLINE __inline
+#  else
+#    define PSNIP_CPU__INLINE
+#  endif
+
+#  define PSNIP_CPU__FUNCTION PSNIP_CPU__COMPILER_ATTRIBUTES static PSNIP_CPU__INLINE
+#endif
+
+#include <stddef.h>
+#if defined(PSNIP_ENABLE_PTHREADS)
+#  include <pthread.h>
+#endif
+
 #if defined(__cplusplus)
 extern "C" {
 #endif
@@ -31,6 +58,7 @@ enum PSnipCPUFeature {
   PSNIP_CPU_FEATURE_CPU_MASK            = 0x1f000000,
   PSNIP_CPU_FEATURE_X86                 = 0x01000000,
   PSNIP_CPU_FEATURE_ARM                 = 0x04000000,
+  PSNIP_CPU_FEATURE_ARM64               = 0x08000000,
 
   /* x86 CPU features are constructed as:
    *
@@ -42,6 +70,16 @@ enum PSnipCPUFeature {
    *   PSNIP_CPU_FEATURE_X86 | (1 << 16) | (2 << 8) | (0) = 0x01010200
    *
    * We should have information for inputs of EAX=0-7 w/ ECX=0.
+   *
+   * Inputs which don't fit that scheme use "eax" values starting at 8:
+   *
+   *   8: EAX=7, ECX=1
+   *   9: EAX=0x80000001
+   *  10: EAX=0x80000007
+   *
+   * Features which need OS support for extra register state (AVX,
+   * AVX-512 and AMX) are only reported if XCR0 says the OS has enabled
+   * that state.
    */
   PSNIP_CPU_FEATURE_X86_FPU             = 0x01010300,
   PSNIP_CPU_FEATURE_X86_VME             = 0x01010301,
@@ -142,12 +180,56 @@ enum PSnipCPUFeature {
   PSNIP_CPU_FEATURE_X86_UMIP            = 0x01070202,
   PSNIP_CPU_FEATURE_X86_PKU             = 0x01070203,
   PSNIP_CPU_FEATURE_X86_OSPKE           = 0x01070204,
+  PSNIP_CPU_FEATURE_X86_WAITPKG         = 0x01070205,
+  PSNIP_CPU_FEATURE_X86_AVX512VBMI2     = 0x01070206,
+  PSNIP_CPU_FEATURE_X86_GFNI            = 0x01070208,
+  PSNIP_CPU_FEATURE_X86_VAES            = 0x01070209,
+  PSNIP_CPU_FEATURE_X86_VPCLMULQDQ      = 0x0107020a,
+  PSNIP_CPU_FEATURE_X86_AVX512VNNI      = 0x0107020b,
+  PSNIP_CPU_FEATURE_X86_AVX512BITALG    = 0x0107020c,
   PSNIP_CPU_FEATURE_X86_AVX512VPOPCNTDQ = 0x0107020e,
-  PSNIP_CPU_FEATURE_X86_RDPID           = 0x01070215,
+  PSNIP_CPU_FEATURE_X86_RDPID           = 0x01070216,
+  PSNIP_CPU_FEATURE_X86_CLDEMOTE        = 0x01070219,
+  PSNIP_CPU_FEATURE_X86_MOVDIRI         = 0x0107021b,
+  PSNIP_CPU_FEATURE_X86_MOVDIR64B       = 0x0107021c,
   PSNIP_CPU_FEATURE_X86_SGX_LC          = 0x0107021e,
 
   PSNIP_CPU_FEATURE_X86_AVX512_4VNNIW   = 0x01070302,
   PSNIP_CPU_FEATURE_X86_AVX512_4FMAPS   = 0x01070303,
+  PSNIP_CPU_FEATURE_X86_FSRM            = 0x01070304,
+  PSNIP_CPU_FEATURE_X86_AVX512VP2INTERSECT = 0x01070308,
+  PSNIP_CPU_FEATURE_X86_SERIALIZE       = 0x0107030e,
+  PSNIP_CPU_FEATURE_X86_HYBRID          = 0x0107030f,
+  PSNIP_CPU_FEATURE_X86_AMX_BF16        = 0x01070316,
+  PSNIP_CPU_FEATURE_X86_AVX512FP16      = 0x01070317,
+  PSNIP_CPU_FEATURE_X86_AMX_TILE        = 0x01070318,
+  PSNIP_CPU_FEATURE_X86_AMX_INT8        = 0x01070319,
+
+  PSNIP_CPU_FEATURE_X86_AVX_VNNI        = 0x01080004,
+  PSNIP_CPU_FEATURE_X86_AVX512BF16      = 0x01080005,
+  PSNIP_CPU_FEATURE_X86_CMPCCXADD       = 0x01080007,
+  PSNIP_CPU_FEATURE_X86_AMX_FP16        = 0x01080015,
+  PSNIP_CPU_FEATURE_X86_AVX_IFMA        = 0x01080017,
+  PSNIP_CPU_FEATURE_X86_AVX_VNNI_INT8   = 0x01080304,
+  PSNIP_CPU_FEATURE_X86_AVX_NE_CONVERT  = 0x01080305,
+  PSNIP_CPU_FEATURE_X86_AMX_COMPLEX     = 0x01080308,
+
+  PSNIP_CPU_FEATURE_X86_LAHF_LM         = 0x01090200,
+  PSNIP_CPU_FEATURE_X86_SVM             = 0x01090202,
+  PSNIP_CPU_FEATURE_X86_LZCNT           = 0x01090205,
+  PSNIP_CPU_FEATURE_X86_ABM             = PSNIP_CPU_FEATURE_X86_LZCNT,
+  PSNIP_CPU_FEATURE_X86_SSE4A           = 0x01090206,
+  PSNIP_CPU_FEATURE_X86_PREFETCHW       = 0x01090208,
+  PSNIP_CPU_FEATURE_X86_XOP             = 0x0109020b,
+  PSNIP_CPU_FEATURE_X86_FMA4            = 0x01090210,
+  PSNIP_CPU_FEATURE_X86_TBM             = 0x01090215,
+  PSNIP_CPU_FEATURE_X86_SYSCALL         = 0x0109030b,
+  PSNIP_CPU_FEATURE_X86_NX              = 0x01090314,
+  PSNIP_CPU_FEATURE_X86_PDPE1GB         = 0x0109031a,
+  PSNIP_CPU_FEATURE_X86_RDTSCP          = 0x0109031b,
+  PSNIP_CPU_FEATURE_X86_LM              = 0x0109031d,
+
+  PSNIP_CPU_FEATURE_X86_INVARIANT_TSC   = 0x010a0308,
 
   PSNIP_CPU_FEATURE_ARM_SWP             = PSNIP_CPU_FEATURE_ARM | 1,
   PSNIP_CPU_FEATURE_ARM_HALF            = PSNIP_CPU_FEATURE_ARM | 2,
@@ -176,13 +258,538 @@ enum PSnipCPUFeature {
   PSNIP_CPU_FEATURE_ARM_PMULL           = PSNIP_CPU_FEATURE_ARM | 0x0100 | 2,
   PSNIP_CPU_FEATURE_ARM_SHA1            = PSNIP_CPU_FEATURE_ARM | 0x0100 | 3,
   PSNIP_CPU_FEATURE_ARM_SHA2            = PSNIP_CPU_FEATURE_ARM | 0x0100 | 4,
-  PSNIP_CPU_FEATURE_ARM_CRC32           = PSNIP_CPU_FEATURE_ARM | 0x0100 | 5
+  PSNIP_CPU_FEATURE_ARM_CRC32           = PSNIP_CPU_FEATURE_ARM | 0x0100 | 5,
+
+  /* AArch64 features are encoded like the 32-bit ARM ones: the bit
+   * number (plus one) in AT_HWCAP, or in AT_HWCAP2 with 0x0100 set.
+   * On AArch64 you can also use the 32-bit names of features which
+   * both have (NEON, VFP, AES, PMULL, SHA1, SHA2 and CRC32). */
+  PSNIP_CPU_FEATURE_ARM64_FP            = PSNIP_CPU_FEATURE_ARM64 | 1,
+  PSNIP_CPU_FEATURE_ARM64_ASIMD         = PSNIP_CPU_FEATURE_ARM64 | 2,
+  PSNIP_CPU_FEATURE_ARM64_EVTSTRM       = PSNIP_CPU_FEATURE_ARM64 | 3,
+  PSNIP_CPU_FEATURE_ARM64_AES           = PSNIP_CPU_FEATURE_ARM64 | 4,
+  PSNIP_CPU_FEATURE_ARM64_PMULL         = PSNIP_CPU_FEATURE_ARM64 | 5,
+  PSNIP_CPU_FEATURE_ARM64_SHA1          = PSNIP_CPU_FEATURE_ARM64 | 6,
+  PSNIP_CPU_FEATURE_ARM64_SHA2          = PSNIP_CPU_FEATURE_ARM64 | 7,
+  PSNIP_CPU_FEATURE_ARM64_CRC32         = PSNIP_CPU_FEATURE_ARM64 | 8,
+  PSNIP_CPU_FEATURE_ARM64_ATOMICS       = PSNIP_CPU_FEATURE_ARM64 | 9,
+  PSNIP_CPU_FEATURE_ARM64_LSE           = PSNIP_CPU_FEATURE_ARM64_ATOMICS,
+  PSNIP_CPU_FEATURE_ARM64_FPHP          = PSNIP_CPU_FEATURE_ARM64 | 10,
+  PSNIP_CPU_FEATURE_ARM64_ASIMDHP       = PSNIP_CPU_FEATURE_ARM64 | 11,
+  PSNIP_CPU_FEATURE_ARM64_FP16          = PSNIP_CPU_FEATURE_ARM64_ASIMDHP,
+  PSNIP_CPU_FEATURE_ARM64_CPUID         = PSNIP_CPU_FEATURE_ARM64 | 12,
+  PSNIP_CPU_FEATURE_ARM64_ASIMDRDM      = PSNIP_CPU_FEATURE_ARM64 | 13,
+  PSNIP_CPU_FEATURE_ARM64_JSCVT         = PSNIP_CPU_FEATURE_ARM64 | 14,
+  PSNIP_CPU_FEATURE_ARM64_FCMA          = PSNIP_CPU_FEATURE_ARM64 | 15,
+  PSNIP_CPU_FEATURE_ARM64_LRCPC         = PSNIP_CPU_FEATURE_ARM64 | 16,
+  PSNIP_CPU_FEATURE_ARM64_DCPOP         = PSNIP_CPU_FEATURE_ARM64 | 17,
+  PSNIP_CPU_FEATURE_ARM64_SHA3          = PSNIP_CPU_FEATURE_ARM64 | 18,
+  PSNIP_CPU_FEATURE_ARM64_SM3           = PSNIP_CPU_FEATURE_ARM64 | 19,
+  PSNIP_CPU_FEATURE_ARM64_SM4           = PSNIP_CPU_FEATURE_ARM64 | 20,
+  PSNIP_CPU_FEATURE_ARM64_ASIMDDP       = PSNIP_CPU_FEATURE_ARM64 | 21,
+  PSNIP_CPU_FEATURE_ARM64_DOTPROD       = PSNIP_CPU_FEATURE_ARM64_ASIMDDP,
+  PSNIP_CPU_FEATURE_ARM64_SHA512        = PSNIP_CPU_FEATURE_ARM64 | 22,
+  PSNIP_CPU_FEATURE_ARM64_SVE           = PSNIP_CPU_FEATURE_ARM64 | 23,
+  PSNIP_CPU_FEATURE_ARM64_ASIMDFHM      = PSNIP_CPU_FEATURE_ARM64 | 24,
+  PSNIP_CPU_FEATURE_ARM64_DIT           = PSNIP_CPU_FEATURE_ARM64 | 25,
+  PSNIP_CPU_FEATURE_ARM64_USCAT         = PSNIP_CPU_FEATURE_ARM64 | 26,
+  PSNIP_CPU_FEATURE_ARM64_ILRCPC        = PSNIP_CPU_FEATURE_ARM64 | 27,
+  PSNIP_CPU_FEATURE_ARM64_FLAGM         = PSNIP_CPU_FEATURE_ARM64 | 28,
+  PSNIP_CPU_FEATURE_ARM64_SSBS          = PSNIP_CPU_FEATURE_ARM64 | 29,
+  PSNIP_CPU_FEATURE_ARM64_SB            = PSNIP_CPU_FEATURE_ARM64 | 30,
+  PSNIP_CPU_FEATURE_ARM64_PACA          = PSNIP_CPU_FEATURE_ARM64 | 31,
+  PSNIP_CPU_FEATURE_ARM64_PACG          = PSNIP_CPU_FEATURE_ARM64 | 32,
+
+  PSNIP_CPU_FEATURE_ARM64_DCPODP        = PSNIP_CPU_FEATURE_ARM64 | 0x0100 | 1,
+  PSNIP_CPU_FEATURE_ARM64_SVE2          = PSNIP_CPU_FEATURE_ARM64 | 0x0100 | 2,
+  PSNIP_CPU_FEATURE_ARM64_SVEAES        = PSNIP_CPU_FEATURE_ARM64 | 0x0100 | 3,
+  PSNIP_CPU_FEATURE_ARM64_SVEPMULL      = PSNIP_CPU_FEATURE_ARM64 | 0x0100 | 4,
+  PSNIP_CPU_FEATURE_ARM64_SVEBITPERM    = PSNIP_CPU_FEATURE_ARM64 | 0x0100 | 5,
+  PSNIP_CPU_FEATURE_ARM64_SVESHA3       = PSNIP_CPU_FEATURE_ARM64 | 0x0100 | 6,
+  PSNIP_CPU_FEATURE_ARM64_SVESM4        = PSNIP_CPU_FEATURE_ARM64 | 0x0100 | 7,
+  PSNIP_CPU_FEATURE_ARM64_FLAGM2        = PSNIP_CPU_FEATURE_ARM64 | 0x0100 | 8,
+  PSNIP_CPU_FEATURE_ARM64_FRINT         = PSNIP_CPU_FEATURE_ARM64 | 0x0100 | 9,
+  PSNIP_CPU_FEATURE_ARM64_SVEI8MM       = PSNIP_CPU_FEATURE_ARM64 | 0x0100 | 10,
+  PSNIP_CPU_FEATURE_ARM64_SVEF32MM      = PSNIP_CPU_FEATURE_ARM64 | 0x0100 | 11,
+  PSNIP_CPU_FEATURE_ARM64_SVEF64MM      = PSNIP_CPU_FEATURE_ARM64 | 0x0100 | 12,
+  PSNIP_CPU_FEATURE_ARM64_SVEBF16       = PSNIP_CPU_FEATURE_ARM64 | 0x0100 | 13,
+  PSNIP_CPU_FEATURE_ARM64_I8MM          = PSNIP_CPU_FEATURE_ARM64 | 0x0100 | 14,
+  PSNIP_CPU_FEATURE_ARM64_BF16          = PSNIP_CPU_FEATURE_ARM64 | 0x0100 | 15,
+  PSNIP_CPU_FEATURE_ARM64_DGH           = PSNIP_CPU_FEATURE_ARM64 | 0x0100 | 16,
+  PSNIP_CPU_FEATURE_ARM64_RNG           = PSNIP_CPU_FEATURE_ARM64 | 0x0100 | 17,
+  PSNIP_CPU_FEATURE_ARM64_BTI           = PSNIP_CPU_FEATURE_ARM64 | 0x0100 | 18,
+  PSNIP_CPU_FEATURE_ARM64_MTE           = PSNIP_CPU_FEATURE_ARM64 | 0x0100 | 19,
+  PSNIP_CPU_FEATURE_ARM64_SME           = PSNIP_CPU_FEATURE_ARM64 | 0x0100 | 24
 };
 
 int psnip_cpu_count              (void);
-int psnip_cpu_feature_check      (enum PSnipCPUFeature  feature);
+int psnip_cpu_count_available    (void);
 int psnip_cpu_feature_check_many (enum PSnipCPUFeature* feature);
 
+/* SVE vector length in bytes, or 0 if SVE isn't available. */
+int psnip_cpu_sve_vector_length (void);
+
+/* Frequency, in Hz, of a cycle counter which ticks at a constant rate
+ * (the invariant TSC on x86, the generic timer on AArch64), or 0 if
+ * there isn't one. */
+double psnip_cpu_tsc_frequency (void);
+
+/* Feature checks
+ *
+ * psnip_cpu_feature_check is inline so it can be used in inner loops.
+ * If the compiler is already targeting a feature (for example, __AVX2__
+ * is defined) it is a constant; otherwise, once the CPU information
+ * has been gathered (by the first check), a supported feature costs a
+ * load and a bit test.  An unsupported one costs a second load, of the
+ * flag which tells us the information is there. */
+
+#if defined(PSNIP_CPU_ARCH_X86) || defined(PSNIP_CPU_ARCH_X86_64)
+#define PSNIP_CPU__X86_INFO_SLOTS 11
+extern unsigned int psnip_cpu__info[];
+#elif defined(PSNIP_CPU_ARCH_ARM) || defined(PSNIP_CPU_ARCH_ARM64)
+extern unsigned long psnip_cpu__info[];
+#endif
+extern int psnip_cpu__info_ready;
+
+int psnip_cpu__feature_check_init (enum PSnipCPUFeature feature);
+
+#if defined(PSNIP_CPU_ARCH_ARM64)
+/* Maps the 32-bit ARM names of features AArch64 also has. */
+PSNIP_CPU__FUNCTION enum PSnipCPUFeature
+psnip_cpu__feature_arm64 (enum PSnipCPUFeature feature) {
+  switch ((unsigned int) feature) {
+    case PSNIP_CPU_FEATURE_ARM_VFP:
+    case PSNIP_CPU_FEATURE_ARM_VFPV3:
+    case PSNIP_CPU_FEATURE_ARM_VFPV4:
+    case PSNIP_CPU_FEATURE_ARM_VFPD32:
+      return PSNIP_CPU_FEATURE_ARM64_FP;
+    case PSNIP_CPU_FEATURE_ARM_NEON:
+      return PSNIP_CPU_FEATURE_ARM64_ASIMD;
+    case PSNIP_CPU_FEATURE_ARM_EVTSTRM:
+      return PSNIP_CPU_FEATURE_ARM64_EVTSTRM;
+    case PSNIP_CPU_FEATURE_ARM_AES:
+      return PSNIP_CPU_FEATURE_ARM64_AES;
+    case PSNIP_CPU_FEATURE_ARM_PMULL:
+      return PSNIP_CPU_FEATURE_ARM64_PMULL;
+    case PSNIP_CPU_FEATURE_ARM_SHA1:
+      return PSNIP_CPU_FEATURE_ARM64_SHA1;
+    case PSNIP_CPU_FEATURE_ARM_SHA2:
+      return PSNIP_CPU_FEATURE_ARM64_SHA2;
+    case PSNIP_CPU_FEATURE_ARM_CRC32:
+      return PSNIP_CPU_FEATURE_ARM64_CRC32;
+    default:
+      return feature;
+  }
+}
+#endif
+
+/* Features which the compiler has been told it may use. */
+PSNIP_CPU__FUNCTION int
+psnip_cpu__feature_compiled (enum PSnipCPUFeature feature) {
+#if defined(PSNIP_CPU_ARCH_ARM64)
+  feature = psnip_cpu__feature_arm64(feature);
+#endif
+
+  switch ((unsigned int) feature) {
+    case PSNIP_CPU_FEATURE_NONE:
+      return 0;
+#if defined(PSNIP_CPU_ARCH_X86) || defined(PSNIP_CPU_ARCH_X86_64)
+#  if defined(__MMX__)
+    case PSNIP_CPU_FEATURE_X86_MMX:
+#  endif
+#  if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+    case PSNIP_CPU_FEATURE_X86_SSE:
+#  endif
+#  if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    case PSNIP_CPU_FEATURE_X86_SSE2:
+#  endif
+#  if defined(__SSE3__)
+    case PSNIP_CPU_FEATURE_X86_SSE3:
+#  endif
+#  if defined(__SSSE3__)
+    case PSNIP_CPU_FEATURE_X86_SSSE3:
+#  endif
+#  if defined(__SSE4_1__)
+    case PSNIP_CPU_FEATURE_X86_SSE4_1:
+#  endif
+#  if defined(__SSE4_2__)
+    case PSNIP_CPU_FEATURE_X86_SSE4_2:
+#  endif
+#  if defined(__POPCNT__)
+    case PSNIP_CPU_FEATURE_X86_POPCNT:
+#  endif
+#  if defined(__AES__)
+    case PSNIP_CPU_FEATURE_X86_AES:
+#  endif
+#  if defined(__PCLMUL__)
+    case PSNIP_CPU_FEATURE_X86_PCLMULQDQ:
+#  endif
+#  if defined(__MOVBE__)
+    case PSNIP_CPU_FEATURE_X86_MOVBE:
+#  endif
+#  if defined(__AVX__)
+    case PSNIP_CPU_FEATURE_X86_AVX:
+#  endif
+#  if defined(__F16C__)
+    case PSNIP_CPU_FEATURE_X86_F16C:
+#  endif
+#  if defined(__FMA__)
+    case PSNIP_CPU_FEATURE_X86_FMA:
+#  endif
+#  if defined(__RDRND__)
+    case PSNIP_CPU_FEATURE_X86_RDRND:
+#  endif
+#  if defined(__AVX2__)
+    case PSNIP_CPU_FEATURE_X86_AVX2:
+#  endif
+#  if defined(__BMI__)
+    case PSNIP_CPU_FEATURE_X86_BMI1:
+#  endif
+#  if defined(__BMI2__)
+    case PSNIP_CPU_FEATURE_X86_BMI2:
+#  endif
+#  if defined(__RDSEED__)
+    case PSNIP_CPU_FEATURE_X86_RDSEED:
+#  endif
+#  if defined(__ADX__)
+    case PSNIP_CPU_FEATURE_X86_ADX:
+#  endif
+#  if defined(__SHA__)
+    case PSNIP_CPU_FEATURE_X86_SHA:
+#  endif
+#  if defined(__AVX512F__)
+    case PSNIP_CPU_FEATURE_X86_AVX512F:
+#  endif
+#  if defined(__AVX512DQ__)
+    case PSNIP_CPU_FEATURE_X86_AVX512DQ:
+#  endif
+#  if defined(__AVX512CD__)
+    case PSNIP_CPU_FEATURE_X86_AVX512CD:
+#  endif
+#  if defined(__AVX512BW__)
+    case PSNIP_CPU_FEATURE_X86_AVX512BW:
+#  endif
+#  if defined(__AVX512VL__)
+    case PSNIP_CPU_FEATURE_X86_AVX512VL:
+#  endif
+#  if defined(__AVX512IFMA__)
+    case PSNIP_CPU_FEATURE_X86_AVX512IFMA:
+#  endif
+#  if defined(__AVX512VBMI__)
+    case PSNIP_CPU_FEATURE_X86_AVX512VBMI:
+#  endif
+#  if defined(__AVX512VPOPCNTDQ__)
+    case PSNIP_CPU_FEATURE_X86_AVX512VPOPCNTDQ:
+#  endif
+#  if defined(__RDPID__)
+    case PSNIP_CPU_FEATURE_X86_RDPID:
+#  endif
+#  if defined(__LZCNT__)
+    case PSNIP_CPU_FEATURE_X86_LZCNT:
+#  endif
+#  if defined(__SSE4A__)
+    case PSNIP_CPU_FEATURE_X86_SSE4A:
+#  endif
+#  if defined(__GFNI__)
+    case PSNIP_CPU_FEATURE_X86_GFNI:
+#  endif
+#  if defined(__VAES__)
+    case PSNIP_CPU_FEATURE_X86_VAES:
+#  endif
+#  if defined(__VPCLMULQDQ__)
+    case PSNIP_CPU_FEATURE_X86_VPCLMULQDQ:
+#  endif
+#  if defined(__AVX512VBMI2__)
+    case PSNIP_CPU_FEATURE_X86_AVX512VBMI2:
+#  endif
+#  if defined(__AVX512VNNI__)
+    case PSNIP_CPU_FEATURE_X86_AVX512VNNI:
+#  endif
+#  if defined(__AVX512BITALG__)
+    case PSNIP_CPU_FEATURE_X86_AVX512BITALG:
+#  endif
+#  if defined(__AVX512BF16__)
+    case PSNIP_CPU_FEATURE_X86_AVX512BF16:
+#  endif
+#  if defined(__AVX512FP16__)
+    case PSNIP_CPU_FEATURE_X86_AVX512FP16:
+#  endif
+#  if defined(__AVXVNNI__)
+    case PSNIP_CPU_FEATURE_X86_AVX_VNNI:
+#  endif
+#elif defined(PSNIP_CPU_ARCH_ARM)
+#  if defined(__ARM_NEON)
+    case PSNIP_CPU_FEATURE_ARM_NEON:
+#  endif
+#  if defined(__ARM_FEATURE_CRYPTO)
+    case PSNIP_CPU_FEATURE_ARM_AES:
+    case PSNIP_CPU_FEATURE_ARM_PMULL:
+    case PSNIP_CPU_FEATURE_ARM_SHA1:
+    case PSNIP_CPU_FEATURE_ARM_SHA2:
+#  endif
+#  if defined(__ARM_FEATURE_CRC32)
+    case PSNIP_CPU_FEATURE_ARM_CRC32:
+#  endif
+#elif defined(PSNIP_CPU_ARCH_ARM64)
+#  if defined(__ARM_FP)
+    case PSNIP_CPU_FEATURE_ARM64_FP:
+#  endif
+#  if defined(__ARM_NEON)
+    case PSNIP_CPU_FEATURE_ARM64_ASIMD:
+#  endif
+#  if defined(__ARM_FEATURE_AES) || defined(__ARM_FEATURE_CRYPTO)
+    case PSNIP_CPU_FEATURE_ARM64_AES:
+    case PSNIP_CPU_FEATURE_ARM64_PMULL:
+#  endif
+#  if defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO)
+    case PSNIP_CPU_FEATURE_ARM64_SHA1:
+    case PSNIP_CPU_FEATURE_ARM64_SHA2:
+#  endif
+#  if defined(__ARM_FEATURE_CRC32)
+    case PSNIP_CPU_FEATURE_ARM64_CRC32:
+#  endif
+#  if defined(__ARM_FEATURE_ATOMICS)
+    case PSNIP_CPU_FEATURE_ARM64_ATOMICS:
+#  endif
+#  if defined(__ARM_FEATURE_FP16_SCALAR_ARITHMETIC)
+    case PSNIP_CPU_FEATURE_ARM64_FPHP:
+#  endif
+#  if defined(__ARM_FEATURE_FP16_VECTOR_ARITHMETIC)
+    case PSNIP_CPU_FEATURE_ARM64_ASIMDHP:
+#  endif
+#  if defined(__ARM_FEATURE_QRDMX)
+    case PSNIP_CPU_FEATURE_ARM64_ASIMDRDM:
+#  endif
+#  if defined(__ARM_FEATURE_SHA3)
+    case PSNIP_CPU_FEATURE_ARM64_SHA3:
+    case PSNIP_CPU_FEATURE_ARM64_SHA512:
+#  endif
+#  if defined(__ARM_FEATURE_DOTPROD)
+    case PSNIP_CPU_FEATURE_ARM64_ASIMDDP:
+#  endif
+#  if defined(__ARM_FEATURE_SVE)
+    case PSNIP_CPU_FEATURE_ARM64_SVE:
+#  endif
+#  if defined(__ARM_FEATURE_SVE2)
+    case PSNIP_CPU_FEATURE_ARM64_SVE2:
+#  endif
+#  if defined(__ARM_FEATURE_MATMUL_INT8)
+    case PSNIP_CPU_FEATURE_ARM64_I8MM:
+#  endif
+#  if defined(__ARM_FEATURE_BF16)
+    case PSNIP_CPU_FEATURE_ARM64_BF16:
+#  endif
+#endif
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+/* Looks the feature up in the CPU information. */
+PSNIP_CPU__FUNCTION int
+psnip_cpu__feature_lookup (enum PSnipCPUFeature feature) {
+#if defined(PSNIP_CPU_ARCH_X86) || defined(PSNIP_CPU_ARCH_X86_64)
+  unsigned int i, r, b;
+
+  if ((feature & PSNIP_CPU_FEATURE_CPU_MASK) != PSNIP_CPU_FEATURE_X86)
+    return 0;
+
+  i = (feature >> 16) & 0xff;
+  r = (feature >>  8) & 0xff;
+  b = (feature      ) & 0xff;
+
+  if (i >= PSNIP_CPU__X86_INFO_SLOTS || r > 3 || b > 31)
+    return 0;
+
+  return (psnip_cpu__info[(i * 4) + r] >> b) & 1;
+#elif defined(PSNIP_CPU_ARCH_ARM) || defined(PSNIP_CPU_ARCH_ARM64)
+  unsigned long b;
+  unsigned int i, n;
+
+#  if defined(PSNIP_CPU_ARCH_ARM64)
+  feature = psnip_cpu__feature_arm64(feature);
+  if ((feature & PSNIP_CPU_FEATURE_CPU_MASK) != PSNIP_CPU_FEATURE_ARM64)
+    return 0;
+#  else
+  if ((feature & PSNIP_CPU_FEATURE_CPU_MASK) != PSNIP_CPU_FEATURE_ARM)
+    return 0;
+#  endif
+
+  i = (feature >> 0x08) & 0xff;
+  n = feature & 0xff;
+  if (i > 1 || n == 0 || n > sizeof(unsigned long) * 8)
+    return 0;
+  b = 1UL << (n - 1);
+
+  return (psnip_cpu__info[i] & b) == b;
+#else
+  (void) feature;
+  return 0;
+#endif
+}
+
+PSNIP_CPU__FUNCTION int
+psnip_cpu__info_is_ready (void) {
+#if defined(__ATOMIC_ACQUIRE) && !defined(__INTEL_COMPILER)
+  return __atomic_load_n(&psnip_cpu__info_ready, __ATOMIC_ACQUIRE);
+#else
+  return *((volatile int*) &psnip_cpu__info_ready);
+#endif
+}
+
+PSNIP_CPU__FUNCTION int
+psnip_cpu_feature_check (enum PSnipCPUFeature feature) {
+  if (psnip_cpu__feature_compiled(feature) || psnip_cpu__feature_lookup(feature))
+    return 1;
+  if (psnip_cpu__info_is_ready())
+    return 0;
+
+  return psnip_cpu__feature_check_init(feature);
+}
+
+/* Dispatch
+ *
+ * A dispatch table lists implementations of a function, best first,
+ * each with the (PSNIP_CPU_FEATURE_NONE-terminated) features it needs.
+ * A NULL feature list means the implementation works everywhere, and
+ * the table ends with an entry whose function is NULL.
+ * psnip_cpu_dispatch_select returns the first implementation whose
+ * features are all supported, or NULL if there isn't one.
+ *
+ * Tables used with PSNIP_CPU_DISPATCH should always end with a generic
+ * entry; if nothing matches, calling the dispatched function prints a
+ * message and aborts. */
+typedef void (*PSnipCPUFunction) (void);
+
+struct PSnipCPUDispatch {
+  PSnipCPUFunction function;
+  enum PSnipCPUFeature* features;
+};
+
+PSnipCPUFunction psnip_cpu_dispatch_select (const struct PSnipCPUDispatch* table);
+PSnipCPUFunction psnip_cpu__dispatch_resolve (const struct PSnipCPUDispatch* table, const char* name);
+#if defined(PSNIP_CPU_ARCH_X86) || defined(PSNIP_CPU_ARCH_X86_64)
+PSnipCPUFunction psnip_cpu__dispatch_select_early (const struct PSnipCPUDispatch* table)
+#  if defined(__ELF__) && defined(__GNUC__)
+  __attribute__((__visibility__("hidden")))
+#  endif
+  ;
+#endif
+
+/* PSNIP_CPU_DISPATCH(ret, name, params, args, table) defines
+ * `ret name params`, which forwards to the implementation selected
+ * from table.  For example:
+ *
+ *   PSNIP_CPU_DISPATCH(int, sum, (const int* v, size_t n), (v, n), sum_table)
+ *
+ * Use PSNIP_CPU_DISPATCH_VOID(name, params, args, table) for functions
+ * which don't return anything.
+ *
+ * The call goes through a function pointer which initially points to
+ * a stub; the first call resolves it, so after that it is a single
+ * indirect jump.  Racing threads all store the same value.
+ *
+ * If PSNIP_CPU_DISPATCH_IFUNC is defined and the toolchain supports
+ * GNU indirect functions (currently only on x86), the dynamic linker
+ * resolves the function instead, so there is no pointer at all.  The
+ * resolver runs during relocation, so it only uses CPUID and XGETBV
+ * and skips entries which need AMX; if nothing matches, it falls back
+ * to the stub.  cpu.c has to be built into the same executable or
+ * library as the dispatched function. */
+#define PSNIP_CPU__DISPATCH_STUB(ret, name, params, args, table, return_) \
+  static ret name##__psnip_cpu_stub params; \
+  static ret (*name##__psnip_cpu_impl) params = name##__psnip_cpu_stub; \
+  static ret name##__psnip_cpu_stub params { \
+    if (name##__psnip_cpu_impl == name##__psnip_cpu_stub) \
+      name##__psnip_cpu_impl = (ret (*) params) psnip_cpu__dispatch_resolve(table, #name); \
+    return_ name##__psnip_cpu_impl args; \
+  }
+
+#if defined(PSNIP_CPU_DISPATCH_IFUNC) && defined(__ELF__) && !defined(__APPLE__) && \
+  (defined(__linux__) || defined(__FreeBSD__)) && \
+  (defined(PSNIP_CPU_ARCH_X86) || defined(PSNIP_CPU_ARCH_X86_64)) && \
+  ((defined(__GNUC__) && ((__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 6))) || defined(__clang__))
+#  define PSNIP_CPU__DISPATCH(ret, name, params, args, table, return_) \
+  PSNIP_CPU__DISPATCH_STUB(ret, name, params, args, table, return_) \
+  static ret (*name##__psnip_cpu_resolve (void)) params { \
+    PSnipCPUFunction function = psnip_cpu__dispatch_select_early(table); \
+    return (function != NULL) ? (ret (*) params) function : name##__psnip_cpu_stub; \
+  } \
+  ret name params __attribute__((__ifunc__(#name "__psnip_cpu_resolve")));
+#else
+#  define PSNIP_CPU__DISPATCH(ret, name, params, args, table, return_) \
+  PSNIP_CPU__DISPATCH_STUB(ret, name, params, args, table, return_) \
+  ret name params { \
+    return_ name##__psnip_cpu_impl args; \
+  }
+#endif
+
+#define PSNIP_CPU_DISPATCH(ret, name, params, args, table) \
+  PSNIP_CPU__DISPATCH(ret, name, params, args, table, return)
+#define PSNIP_CPU_DISPATCH_VOID(name, params, args, table) \
+  PSNIP_CPU__DISPATCH(void, name, params, args, table, )
+
+/* Affinity */
+int psnip_cpu_pin         (int cpu);
+int psnip_cpu_pin_set     (const int* cpus, int count);
+#if defined(PSNIP_ENABLE_PTHREADS)
+int psnip_cpu_thread_pin_set (pthread_t thread, const int* cpus, int count);
+#endif
+int psnip_cpu_current     (void);
+int psnip_cpu_allowed     (int* cpus, int max);
+
+/* Caches
+ *
+ * The type values match the ones used by CPUID leaf 4 on x86. */
+enum PSnipCPUCacheType {
+  PSNIP_CPU_CACHE_TYPE_NULL        = 0,
+  PSNIP_CPU_CACHE_TYPE_DATA        = 1,
+  PSNIP_CPU_CACHE_TYPE_INSTRUCTION = 2,
+  PSNIP_CPU_CACHE_TYPE_UNIFIED     = 3
+};
+
+struct PSnipCPUCache {
+  int level;
+  enum PSnipCPUCacheType type;
+  size_t size;        /* bytes */
+  int line_size;      /* bytes */
+  int associativity;  /* ways, or 0 if unknown */
+  int shared_by;      /* logical CPUs sharing this cache, or 0 if unknown */
+};
+
+int                         psnip_cpu_cache_count (void);
+const struct PSnipCPUCache* psnip_cpu_cache_get   (int index);
+const struct PSnipCPUCache* psnip_cpu_cache_find  (int level, enum PSnipCPUCacheType type);
+
+/* Topology
+ *
+ * One entry per online logical CPU, sorted by cpu number.  IDs are
+ * whatever the OS reports, so they may not be contiguous. */
+enum PSnipCPUCoreType {
+  PSNIP_CPU_CORE_TYPE_UNKNOWN     = 0,
+  PSNIP_CPU_CORE_TYPE_PERFORMANCE = 1,
+  PSNIP_CPU_CORE_TYPE_EFFICIENCY  = 2
+};
+
+struct PSnipCPUTopology {
+  int cpu;      /* logical CPU number, as used for affinity */
+  int package;  /* physical package (socket) */
+  int core;     /* core ID, unique within the package */
+  int thread;   /* index of this CPU among the SMT siblings of its core */
+  int node;     /* NUMA node */
+  enum PSnipCPUCoreType core_type;
+  int capacity; /* relative performance; 1024 for the fastest CPUs, 0 if unknown */
+};
+
+int                            psnip_cpu_topology_count (void);
+const struct PSnipCPUTopology* psnip_cpu_topology_get   (int index);
+const struct PSnipCPUTopology* psnip_cpu_topology_find  (int cpu);
+
+int psnip_cpu_node_count    (void);
+int psnip_cpu_node_id       (int index);
+int psnip_cpu_node_distance (int from, int to);
+
 #if defined(__cplusplus)
 }
 #endif
@@ -14,15 +14,20 @@
 #include <assert.h>
 #include <string.h>
 #include <stdio.h>
+#include <math.h>
 
 #if !defined(_WIN32)
 #  include <sys/types.h>
 #  include <unistd.h>
 #endif
 
+/* GCC (10+) also supports __has_builtin, but it reports false for
+ * builtins which require an ISA extension that isn't enabled for the
+ * whole translation unit, even though we can use them in functions
+ * with the appropriate target attribute. */
 #if defined(PSNIP_CPU_ARCH_X86_64) || defined(PSNIP_CPU_ARCH_X86)
-#  if defined(__has_builtin)
-#    if defined(__clang__) && (__clang_major__ == 3 && __clang_minor__ == 5)
+#  if defined(__clang__) && defined(__has_builtin)
+#    if (__clang_major__ == 3 && __clang_minor__ == 5)
 #    elif __has_builtin(__builtin_ia32_rdrand64_step) || __has_builtin(__builtin_ia32_rdrand32_step)
 #      define PSNIP_RANDOM__SECURE_ALLOW_RDRAND
 #    endif
@@ -31,6 +36,139 @@
 #  endif
 #endif
 
+#if defined(PSNIP_RANDOM__SECURE_ALLOW_RDRAND)
+#  if defined(__clang__) && defined(__has_builtin)
+#    if __has_builtin(__builtin_ia32_rdseed32_step)
+#      define PSNIP_RANDOM__ALLOW_RDSEED
+#    endif
+#  elif (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#    define PSNIP_RANDOM__ALLOW_RDSEED
+#  endif
+#endif
+
+#if (defined(PSNIP_CPU_ARCH_X86_64) || defined(PSNIP_CPU_ARCH_X86)) && !defined(PSNIP_RANDOM_NO_SIMD)
+#  if defined(__AVX2__)
+#    define PSNIP_RANDOM__AVX2
+#    define PSNIP_RANDOM__AVX2_ATTRIBUTES
+#  elif defined(__clang__)
+#    if (__clang_major__ > 3 || (__clang_major__ == 3 && __clang_minor__ >= 8))
+#      define PSNIP_RANDOM__AVX2
+#      define PSNIP_RANDOM__AVX2_ATTRIBUTES __attribute__((__target__("avx2")))
+#    endif
+#  elif defined(__GNUC__) && !defined(__INTEL_COMPILER)
+#    if (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#      define PSNIP_RANDOM__AVX2
+#      define PSNIP_RANDOM__AVX2_ATTRIBUTES __attribute__((__target__("avx2")))
+#    endif
+#  elif defined(_MSC_VER) && (_MSC_VER >= 1700)
+#    define PSNIP_RANDOM__AVX2
+#    define PSNIP_RANDOM__AVX2_ATTRIBUTES
+#  endif
+#endif
+
+#if (defined(PSNIP_CPU_ARCH_X86_64) || defined(PSNIP_CPU_ARCH_X86)) && !defined(PSNIP_RANDOM_NO_SIMD)
+#  if defined(__SSE2__) || defined(PSNIP_CPU_ARCH_X86_64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#    define PSNIP_RANDOM__SSE2
+#    define PSNIP_RANDOM__SSE2_ATTRIBUTES
+#  elif (defined(__clang__) && (__clang_major__ > 3 || (__clang_major__ == 3 && __clang_minor__ >= 8))) || \
+  (defined(__GNUC__) && !defined(__clang__) && !defined(__INTEL_COMPILER) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#    define PSNIP_RANDOM__SSE2
+#    define PSNIP_RANDOM__SSE2_ATTRIBUTES __attribute__((__target__("sse2")))
+#  endif
+#endif
+
+#if defined(PSNIP_RANDOM__SSE2)
+#  if defined(__SSE4_1__)
+#    define PSNIP_RANDOM__SSE4_1
+#    define PSNIP_RANDOM__SSE4_1_ATTRIBUTES
+#  elif (defined(__clang__) && (__clang_major__ > 3 || (__clang_major__ == 3 && __clang_minor__ >= 8))) || \
+  (defined(__GNUC__) && !defined(__clang__) && !defined(__INTEL_COMPILER) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#    define PSNIP_RANDOM__SSE4_1
+#    define PSNIP_RANDOM__SSE4_1_ATTRIBUTES __attribute__((__target__("sse4.1")))
+#  elif defined(_MSC_VER) && (_MSC_VER >= 1700)
+#    define PSNIP_RANDOM__SSE4_1
+#    define PSNIP_RANDOM__SSE4_1_ATTRIBUTES
+#  endif
+#endif
+
+#if (defined(__ARM_NEON) || defined(__ARM_NEON__)) && !defined(PSNIP_RANDOM_NO_SIMD)
+#  define PSNIP_RANDOM__NEON
+#endif
+
+#if defined(PSNIP_RANDOM__AVX2)
+#  include <immintrin.h>
+#elif defined(PSNIP_RANDOM__SSE4_1)
+#  include <smmintrin.h>
+#elif defined(PSNIP_RANDOM__SSE2)
+#  include <emmintrin.h>
+#endif
+#if defined(PSNIP_RANDOM__NEON)
+#  include <arm_neon.h>
+#endif
+
+#if !defined(PSNIP_RANDOM_NO_THREAD_LOCAL)
+#  if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L) && !defined(__STDC_NO_THREADS__)
+#    define PSNIP_RANDOM__THREAD_LOCAL _Thread_local
+#  elif defined(__GNUC__) && (__GNUC__ > 3 || (__GNUC__ == 3 && __GNUC_MINOR__ >= 3))
+#    define PSNIP_RANDOM__THREAD_LOCAL __thread
+#  elif defined(_MSC_VER)
+#    define PSNIP_RANDOM__THREAD_LOCAL __declspec(thread)
+#  endif
+#endif
+
+#if defined(PSNIP_RANDOM__THREAD_LOCAL) && !defined(PSNIP_RANDOM_SECURE_NO_POOL)
+#  define PSNIP_RANDOM__SECURE_POOL
+#endif
+
+/* Fork detection
+ *
+ * Anything which buffers random data (or state) in memory has to know
+ * when the process has forked, otherwise the parent and child will
+ * hand out the same values.  When we can, we register a pthread_atfork
+ * handler which bumps a generation counter in the child, so checking
+ * for a fork is just an atomic load.  Otherwise we fall back on
+ * comparing PIDs, which is correct but requires a syscall. */
+
+#if !defined(_WIN32) && !defined(PSNIP_RANDOM__HAVE_ATFORK)
+#  if defined(PSNIP_ENABLE_PTHREADS) || defined(__APPLE__) || \
+  (defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 34)))
+#    include <pthread.h>
+#    define PSNIP_RANDOM__HAVE_ATFORK
+#  endif
+#endif
+
+#if defined(PSNIP_RANDOM__HAVE_ATFORK)
+static psnip_atomic_int32 psnip_random__fork_generation = 0;
+static psnip_once psnip_random__fork_once = PSNIP_ONCE_INIT;
+
+static void
+psnip_random__fork_child(void) {
+  psnip_atomic_int32_add(&psnip_random__fork_generation, 1);
+}
+
+static void
+psnip_random__fork_init(void) {
+  pthread_atfork(NULL, NULL, psnip_random__fork_child);
+}
+
+static psnip_int32_t
+psnip_random__fork_generation_get(void) {
+  psnip_once_call(&psnip_random__fork_once, &psnip_random__fork_init);
+
+  return psnip_atomic_int32_load(&psnip_random__fork_generation);
+}
+#elif !defined(_WIN32)
+static psnip_int32_t
+psnip_random__fork_generation_get(void) {
+  return (psnip_int32_t) getpid();
+}
+#else
+static psnip_int32_t
+psnip_random__fork_generation_get(void) {
+  return 0;
+}
+#endif
+
 static int (* psnip_random_secure_generate)(size_t length, psnip_uint8_t data[PSNIP_RANDOM_ARRAY_PARAM(length)]) = NULL;
 static psnip_once psnip_random_secure_once = PSNIP_ONCE_INIT;
 
@@ -89,48 +227,114 @@ psnip_random_secure_generate_getrandom(size_t length, psnip_uint8_t data[PSNIP_R
 #    include <immintrin.h>
 #  endif
 
+/* Intel's DRNG guide recommends giving up on RDRAND after 10 failed
+ * attempts in a row, since that indicates a hardware problem rather
+ * than a transient underflow.  RDSEED underflows much more easily, so
+ * it gets more attempts with a pause between them. */
+#define PSNIP_RANDOM__RDRAND_RETRIES 10
+#define PSNIP_RANDOM__RDSEED_RETRIES 128
+
+#if defined(PSNIP_CPU_ARCH_X86_64)
+typedef unsigned long long int psnip_random__hw_word;
+#else
+typedef unsigned int psnip_random__hw_word;
+#endif
+
 #if defined(__GNUC__) && !defined(__INTEL_COMPILER)
 __attribute__((__target__("rdrnd")))
 #endif
 static int
-psnip_random__rdrand (size_t length, psnip_uint8_t data[PSNIP_RANDOM_ARRAY_PARAM(length)]) {
-  size_t remaining = length;
-  unsigned int r;
-#if defined(PSNIP_CPU_ARCH_X86_64)
-  unsigned long long int v;
-#else
-  unsigned int v;
-#endif
+psnip_random__rdrand_step (psnip_random__hw_word* v) {
+  int i;
 
-  while (remaining > 0) {
-    do {
+  for (i = 0 ; i < PSNIP_RANDOM__RDRAND_RETRIES ; i++) {
 #if defined(PSNIP_CPU_ARCH_X86_64)
 #  if defined(__GNUC__)
-      r = __builtin_ia32_rdrand64_step(&v);
+    if (__builtin_ia32_rdrand64_step(v))
 #  else
-      r = _rdrand64_step(&v);
+    if (_rdrand64_step(v))
 #  endif
 #else
 #  if defined(__GNUC__)
-      r = __builtin_ia32_rdrand32_step(&v);
+    if (__builtin_ia32_rdrand32_step(v))
 #  else
-      r = _rdrand32_step(&v);
+    if (_rdrand32_step(v))
 #  endif
 #endif
-    } while (r == 0);
+      return 1;
+  }
 
-    if (remaining >= sizeof(v)) {
-      memcpy(&(data[length - remaining]), &v, sizeof(v));
-      remaining -= sizeof(v);
-    } else {
-      memcpy(&(data[length - remaining]), &v, remaining);
-      remaining = 0;
-    }
+  return 0;
+}
+
+/* Each iteration of the main loop issues four independent RDRAND
+ * instructions, which lets the CPU keep several requests to the DRNG
+ * in flight. */
+#if defined(__GNUC__) && !defined(__INTEL_COMPILER)
+__attribute__((__target__("rdrnd")))
+#endif
+static int
+psnip_random__rdrand (size_t length, psnip_uint8_t data[PSNIP_RANDOM_ARRAY_PARAM(length)]) {
+  psnip_random__hw_word v[4];
+  size_t offset = 0;
+
+  for ( ; (length - offset) >= sizeof(v) ; offset += sizeof(v)) {
+    if (!psnip_random__rdrand_step(&(v[0])) ||
+	!psnip_random__rdrand_step(&(v[1])) ||
+	!psnip_random__rdrand_step(&(v[2])) ||
+	!psnip_random__rdrand_step(&(v[3])))
+      return -6;
+
+    memcpy(&(data[offset]), v, sizeof(v));
+  }
+
+  for ( ; offset < length ; offset += sizeof(v[0])) {
+    if (!psnip_random__rdrand_step(&(v[0])))
+      return -6;
+
+    memcpy(&(data[offset]), &(v[0]), ((length - offset) < sizeof(v[0])) ? (length - offset) : sizeof(v[0]));
   }
 
   return 0;
 }
+
+#if defined(PSNIP_RANDOM__ALLOW_RDSEED)
+#if defined(__GNUC__) && !defined(__INTEL_COMPILER)
+__attribute__((__target__("rdseed")))
+#endif
+static int
+psnip_random__rdseed_step (psnip_random__hw_word* v) {
+  int i;
+
+  for (i = 0 ; i < PSNIP_RANDOM__RDSEED_RETRIES ; i++) {
+#if defined(PSNIP_CPU_ARCH_X86_64)
+    if (_rdseed64_step(v))
+#else
+    if (_rdseed32_step(v))
 #endif
+      return 1;
+    _mm_pause();
+  }
+
+  return 0;
+}
+#endif /* defined(PSNIP_RANDOM__ALLOW_RDSEED) */
+#endif /* defined(PSNIP_RANDOM__SECURE_ALLOW_RDRAND) */
+
+/* Hardware */
+
+static int
+psnip_random__hardware_generate (size_t length, psnip_uint8_t data[PSNIP_RANDOM_ARRAY_PARAM(length)]) {
+#if defined(PSNIP_RANDOM__SECURE_ALLOW_RDRAND)
+  if (psnip_cpu_feature_check(PSNIP_CPU_FEATURE_X86_RDRND))
+    return psnip_random__rdrand(length, data);
+#endif
+
+  (void) length;
+  (void) data;
+
+  return -1;
+}
 
 #if defined(_WIN32)
 static HMODULE psnip_rand_secure__advapi32_dll = NULL;
@@ -161,46 +365,136 @@ psnip_random_secure_init(void) {
 #endif /* defined(_WIN32) */
 
 #if !defined(PSNIP_RANDOM_SECURE_FOUND)
+#  include <errno.h>
+#  include <fcntl.h>
+#  include <sys/stat.h>
+#  if !defined(O_CLOEXEC)
+#    define O_CLOEXEC 0
+#  endif
+
+/* The device is opened once and the descriptor is kept for the life
+ * of the process.  We use a raw descriptor instead of stdio so nothing
+ * is buffered in userspace (which would be duplicated by fork), and
+ * O_CLOEXEC so it doesn't leak into child processes across exec.
+ *
+ * After a fork the child may have closed the descriptor (daemons often
+ * close everything) and the number may have been reused, so the first
+ * time it is used after a fork we check that it still refers to the
+ * same device, and reopen it if it doesn't. */
+struct PSnipRandomDevice {
+  const char* path;
+  psnip_atomic_int32 fd;
+  psnip_atomic_int32 fork_generation;
+  dev_t rdev;
+};
+
+static struct PSnipRandomDevice psnip_random__dev_urandom =
+  { "/dev/urandom", PSNIP_ATOMIC_VAR_INIT(-1), PSNIP_ATOMIC_VAR_INIT(0), 0 };
+static struct PSnipRandomDevice psnip_random__dev_random =
+  { "/dev/random",  PSNIP_ATOMIC_VAR_INIT(-1), PSNIP_ATOMIC_VAR_INIT(0), 0 };
+
 static int
-psnip_random_secure_generate_dev_random(size_t length, psnip_uint8_t data[PSNIP_RANDOM_ARRAY_PARAM(length)]) {
-  static FILE* dev_random = NULL;
-  size_t bytes_read = 0;
+psnip_random__device_check(struct PSnipRandomDevice* device, int fd) {
+  struct stat st;
+
+  if (fstat(fd, &st) != 0 || !S_ISCHR(st.st_mode))
+    return 0;
 
-  if (dev_random == NULL) {
-    dev_random = fopen("/dev/random", "rb");
-    if (dev_random == NULL)
-      return -1;
+  return device->rdev == 0 || device->rdev == st.st_rdev;
+}
+
+static int
+psnip_random__device_open(struct PSnipRandomDevice* device) {
+  struct stat st;
+  int fd;
+
+  do {
+    fd = open(device->path, O_RDONLY | O_CLOEXEC);
+  } while (fd == -1 && errno == EINTR);
+
+  if (fd == -1)
+    return -1;
+
+  if (fstat(fd, &st) != 0 || !S_ISCHR(st.st_mode) ||
+      (device->rdev != 0 && device->rdev != st.st_rdev)) {
+    close(fd);
+    return -1;
   }
 
-  if (length > 0) {
-    bytes_read = fread(data, 1, length, dev_random);
-    if (bytes_read != length)
-      return -5;
+  /* Only set during initialization, which happens under
+   * psnip_random_secure_once. */
+  if (device->rdev == 0)
+    device->rdev = st.st_rdev;
+
+  return fd;
+}
+
+static int
+psnip_random__device_get_fd(struct PSnipRandomDevice* device) {
+  const psnip_int32_t fork_generation = psnip_random__fork_generation_get();
+  psnip_int32_t fd = psnip_atomic_int32_load(&(device->fd));
+  psnip_int32_t new_fd;
+
+  if (fd != -1) {
+    if (psnip_atomic_int32_load(&(device->fork_generation)) == fork_generation)
+      return (int) fd;
+
+    if (psnip_random__device_check(device, (int) fd)) {
+      psnip_atomic_int32_store(&(device->fork_generation), fork_generation);
+      return (int) fd;
+    }
   }
 
-  return 0;
+  /* We don't close the old descriptor; if it's no longer ours it
+   * belongs to someone else now. */
+  new_fd = (psnip_int32_t) psnip_random__device_open(device);
+  if (new_fd == -1)
+    return -1;
+
+  if (!psnip_atomic_int32_compare_exchange(&(device->fd), &fd, new_fd)) {
+    /* Another thread beat us to it.  Not every atomic backend writes
+     * the current value back to fd, so load it again. */
+    close((int) new_fd);
+    new_fd = psnip_atomic_int32_load(&(device->fd));
+  }
+  psnip_atomic_int32_store(&(device->fork_generation), fork_generation);
+
+  return (int) new_fd;
 }
 
 static int
-psnip_random_secure_generate_dev_urandom(size_t length, psnip_uint8_t data[PSNIP_RANDOM_ARRAY_PARAM(length)]) {
-  static FILE* dev_urandom = NULL;
+psnip_random__device_read(struct PSnipRandomDevice* device, size_t length, psnip_uint8_t data[PSNIP_RANDOM_ARRAY_PARAM(length)]) {
   size_t bytes_read = 0;
+  ssize_t r;
+  int fd;
 
-  if (dev_urandom == NULL) {
-    dev_urandom = fopen("/dev/random", "rb");
-    if (dev_urandom == NULL)
-      return -1;
-  }
+  fd = psnip_random__device_get_fd(device);
+  if (fd == -1)
+    return -1;
 
-  if (length > 0) {
-    bytes_read = fread(data, 1, length, dev_urandom);
-    if (bytes_read != length)
+  while (bytes_read < length) {
+    r = read(fd, &(data[bytes_read]), length - bytes_read);
+    if (r > 0)
+      bytes_read += (size_t) r;
+    else if (r == -1 && errno == EINTR)
+      continue;
+    else
       return -5;
   }
 
   return 0;
 }
 
+static int
+psnip_random_secure_generate_dev_random(size_t length, psnip_uint8_t data[PSNIP_RANDOM_ARRAY_PARAM(length)]) {
+  return psnip_random__device_read(&psnip_random__dev_random, length, data);
+}
+
+static int
+psnip_random_secure_generate_dev_urandom(size_t length, psnip_uint8_t data[PSNIP_RANDOM_ARRAY_PARAM(length)]) {
+  return psnip_random__device_read(&psnip_random__dev_urandom, length, data);
+}
+
 static void
 psnip_random_secure_init(void) {
 #if defined(__linux) && defined(SYS_getrandom)
@@ -229,6 +523,142 @@ psnip_random_secure_init(void) {
 }
 #endif
 
+/* Secure pool
+ *
+ * Small requests for secure data are served from a per-thread buffer
+ * of ChaCha20 output instead of going to the OS every time.  The key
+ * comes from the OS source, and we use "fast key erasure": each time
+ * the buffer is refilled the first 32 bytes of output become the new
+ * key, and bytes are wiped from the buffer as soon as they are handed
+ * out, so compromising the state doesn't reveal previous output.  The
+ * key is replaced with fresh data from the OS after
+ * PSNIP_RANDOM__SECURE_POOL_RESEED_INTERVAL bytes, and after a fork.
+ *
+ * Define PSNIP_RANDOM_SECURE_NO_POOL to always use the OS source. */
+
+#if defined(PSNIP_RANDOM__SECURE_POOL)
+#define PSNIP_RANDOM__ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define PSNIP_RANDOM__CHACHA20_QR(a, b, c, d)	\
+  a += b; d ^= a; d = PSNIP_RANDOM__ROTL32(d, 16); \
+  c += d; b ^= c; b = PSNIP_RANDOM__ROTL32(b, 12); \
+  a += b; d ^= a; d = PSNIP_RANDOM__ROTL32(d,  8); \
+  c += d; b ^= c; b = PSNIP_RANDOM__ROTL32(b,  7)
+
+static void
+psnip_random__chacha20_block(const psnip_uint32_t input[16], psnip_uint8_t output[64]) {
+  psnip_uint32_t x[16];
+  size_t i;
+
+  memcpy(x, input, sizeof(x));
+
+  for (i = 0 ; i < 10 ; i++) {
+    PSNIP_RANDOM__CHACHA20_QR(x[0], x[4], x[ 8], x[12]);
+    PSNIP_RANDOM__CHACHA20_QR(x[1], x[5], x[ 9], x[13]);
+    PSNIP_RANDOM__CHACHA20_QR(x[2], x[6], x[10], x[14]);
+    PSNIP_RANDOM__CHACHA20_QR(x[3], x[7], x[11], x[15]);
+    PSNIP_RANDOM__CHACHA20_QR(x[0], x[5], x[10], x[15]);
+    PSNIP_RANDOM__CHACHA20_QR(x[1], x[6], x[11], x[12]);
+    PSNIP_RANDOM__CHACHA20_QR(x[2], x[7], x[ 8], x[13]);
+    PSNIP_RANDOM__CHACHA20_QR(x[3], x[4], x[ 9], x[14]);
+  }
+
+  for (i = 0 ; i < 16 ; i++) {
+    x[i] += input[i];
+    output[(i * 4) + 0] = (psnip_uint8_t) (x[i]      );
+    output[(i * 4) + 1] = (psnip_uint8_t) (x[i] >>  8);
+    output[(i * 4) + 2] = (psnip_uint8_t) (x[i] >> 16);
+    output[(i * 4) + 3] = (psnip_uint8_t) (x[i] >> 24);
+  }
+}
+
+#define PSNIP_RANDOM__SECURE_POOL_BLOCKS           16
+#define PSNIP_RANDOM__SECURE_POOL_MAX_REQUEST      256
+#define PSNIP_RANDOM__SECURE_POOL_RESEED_INTERVAL  (1024 * 1024)
+
+struct PSnipRandomSecurePool {
+  psnip_uint32_t key[8];
+  psnip_uint8_t buf[PSNIP_RANDOM__SECURE_POOL_BLOCKS * 64];
+  size_t available;
+  size_t generated;
+  psnip_int32_t fork_generation;
+  int seeded;
+};
+
+static PSNIP_RANDOM__THREAD_LOCAL struct PSnipRandomSecurePool psnip_random__secure_pool;
+
+static int
+psnip_random__secure_pool_refill(struct PSnipRandomSecurePool* pool, psnip_int32_t fork_generation) {
+  psnip_uint32_t input[16];
+  size_t i;
+  int r;
+
+  if (!pool->seeded ||
+      pool->fork_generation != fork_generation ||
+      pool->generated >= PSNIP_RANDOM__SECURE_POOL_RESEED_INTERVAL) {
+    r = psnip_random_secure_generate(sizeof(pool->key), (psnip_uint8_t*) pool->key);
+    if (r != 0)
+      return r;
+
+    pool->fork_generation = fork_generation;
+    pool->generated = 0;
+    pool->seeded = 1;
+  }
+
+  /* "expand 32-byte k" */
+  input[0] = 0x61707865U;
+  input[1] = 0x3320646eU;
+  input[2] = 0x79622d32U;
+  input[3] = 0x6b206574U;
+  memcpy(&(input[4]), pool->key, sizeof(pool->key));
+  input[13] = input[14] = input[15] = 0;
+
+  for (i = 0 ; i < PSNIP_RANDOM__SECURE_POOL_BLOCKS ; i++) {
+    input[12] = (psnip_uint32_t) i;
+    psnip_random__chacha20_block(input, &(pool->buf[i * 64]));
+  }
+
+  memcpy(pool->key, pool->buf, sizeof(pool->key));
+  memset(pool->buf, 0, sizeof(pool->key));
+  memset(input, 0, sizeof(input));
+  pool->available = sizeof(pool->buf) - sizeof(pool->key);
+
+  return 0;
+}
+
+static int
+psnip_random__secure_pool_generate(size_t length, psnip_uint8_t data[PSNIP_RANDOM_ARRAY_PARAM(length)]) {
+  struct PSnipRandomSecurePool* pool = &psnip_random__secure_pool;
+  const psnip_int32_t fork_generation = psnip_random__fork_generation_get();
+  psnip_uint8_t* src;
+  size_t n;
+  int r;
+
+  if (pool->fork_generation != fork_generation)
+    pool->available = 0;
+
+  while (length > 0) {
+    if (pool->available == 0) {
+      r = psnip_random__secure_pool_refill(pool, fork_generation);
+      if (r != 0)
+	return r;
+    }
+
+    n = (length < pool->available) ? length : pool->available;
+    src = &(pool->buf[sizeof(pool->buf) - pool->available]);
+    memcpy(data, src, n);
+    memset(src, 0, n);
+
+    pool->available -= n;
+    pool->generated += n;
+    data += n;
+    length -= n;
+  }
+
+  return 0;
+}
+#endif /* defined(PSNIP_RANDOM__SECURE_POOL) */
+
 /* http://burtleburtle.net/bob/hash/integer.html */
 static psnip_uint32_t psnip_random__seed_hash(psnip_uint32_t a) {
   a  = (a ^ 61) ^ (a >> 16);
@@ -271,6 +701,13 @@ psnip_random__pcg_gen_seed(void) {
   res ^= psnip_random__seed_hash((psnip_uint32_t) cur_time.nanoseconds);
   res ^= psnip_random__seed_hash((psnip_uint32_t) cur_time.seconds);
   res ^= psnip_random__seed_hash((psnip_uint32_t) rand());
+#if defined(PSNIP_RANDOM__ALLOW_RDSEED)
+  if (psnip_cpu_feature_check(PSNIP_CPU_FEATURE_X86_RDSEED)) {
+    psnip_random__hw_word v;
+    if (psnip_random__rdseed_step(&v))
+      res ^= psnip_random__seed_hash((psnip_uint32_t) v);
+  }
+#endif
 #if !defined(_WIN32)
   res ^= psnip_random__seed_hash((psnip_uint32_t) getpid());
   res ^= psnip_random__seed_hash((psnip_uint32_t) getppid());
@@ -296,38 +733,606 @@ psnip_random__pcg_from_state(psnip_uint32_t state) {
   return res;
 }
 
+/* Bulk generation
+ *
+ * Filling large buffers one value at a time is bound by the latency
+ * of the multiply in the LCG, so for large requests we run several
+ * copies of the generator side by side.  The lanes are interleaved:
+ * lane i produces values i, i + N, i + 2N, etc. of the sequence, and
+ * every lane steps N values at a time using a multiplier and
+ * increment computed with the jump-ahead algorithm.  This means the
+ * output is identical to generating one value at a time, no matter
+ * which code path (or how many lanes) is used.
+ *
+ * The scalar version just gives the CPU independent multiplies to
+ * overlap.  The AVX2, SSE4.1, SSE2 and NEON versions of the 32-bit
+ * generator use two vectors of lanes for the same reason.  SSE has
+ * no per-lane shift and SSE2 has no 32-bit multiply, so those are
+ * emulated, but the result is still faster than the scalar lanes.
+ * There are no SSE or NEON versions of the 64-bit generator since
+ * neither has a 64-bit multiply, and emulating one with 32-bit
+ * multiplies makes it slower than the scalar code. */
+
+#define PSNIP_RANDOM__BULK_MIN_LENGTH 256
+
+/* See psnip_random__pcg64_jump, below. */
+static void
+psnip_random__pcg_jump(psnip_uint32_t delta, psnip_uint32_t* multiplier_out, psnip_uint32_t* increment_out) {
+  psnip_uint32_t acc_mult = 1, acc_plus = 0;
+  psnip_uint32_t cur_mult = PSNIP_RANDOM__PCG_MULTIPLIER, cur_plus = PSNIP_RANDOM__PCG_INCREMENT;
+
+  while (delta > 0) {
+    if (delta & 1) {
+      acc_mult *= cur_mult;
+      acc_plus = acc_plus * cur_mult + cur_plus;
+    }
+    cur_plus = (cur_mult + 1) * cur_plus;
+    cur_mult *= cur_mult;
+    delta >>= 1;
+  }
+
+  *multiplier_out = acc_mult;
+  *increment_out = acc_plus;
+}
+
+#define PSNIP_RANDOM__PCG_LANES 8
+
+static size_t
+psnip_random__pcg_fill_lanes(psnip_uint32_t* state, size_t length, psnip_uint8_t data[PSNIP_RANDOM_ARRAY_PARAM(length)]) {
+  psnip_uint32_t lanes[PSNIP_RANDOM__PCG_LANES], v[PSNIP_RANDOM__PCG_LANES];
+  psnip_uint32_t multiplier, increment;
+  size_t offset, i;
+
+  lanes[0] = *state;
+  for (i = 1 ; i < PSNIP_RANDOM__PCG_LANES ; i++)
+    lanes[i] = psnip_random__pcg_next_state(lanes[i - 1]);
+  psnip_random__pcg_jump(PSNIP_RANDOM__PCG_LANES, &multiplier, &increment);
+
+  for (offset = 0 ; (length - offset) >= sizeof(v) ; offset += sizeof(v)) {
+    for (i = 0 ; i < PSNIP_RANDOM__PCG_LANES ; i++) {
+      v[i] = psnip_random__pcg_from_state(lanes[i]);
+      lanes[i] = lanes[i] * multiplier + increment;
+    }
+    memcpy(&(data[offset]), v, sizeof(v));
+  }
+
+  *state = lanes[0];
+  return offset;
+}
+
+#if defined(PSNIP_RANDOM__AVX2)
+PSNIP_RANDOM__AVX2_ATTRIBUTES
+static __m256i
+psnip_random__pcg_from_state_avx2(__m256i state) {
+  __m256i res;
+
+  res = _mm256_srlv_epi32(state, _mm256_add_epi32(_mm256_srli_epi32(state, 28), _mm256_set1_epi32(4)));
+  res = _mm256_mullo_epi32(_mm256_xor_si256(res, state), _mm256_set1_epi32(277803737));
+  return _mm256_xor_si256(res, _mm256_srli_epi32(res, 22));
+}
+
+PSNIP_RANDOM__AVX2_ATTRIBUTES
+static size_t
+psnip_random__pcg_fill_avx2(psnip_uint32_t* state, size_t length, psnip_uint8_t data[PSNIP_RANDOM_ARRAY_PARAM(length)]) {
+  psnip_uint32_t lanes[16];
+  psnip_uint32_t multiplier, increment;
+  __m256i s0, s1, m, p;
+  size_t offset, i;
+
+  lanes[0] = *state;
+  for (i = 1 ; i < 16 ; i++)
+    lanes[i] = psnip_random__pcg_next_state(lanes[i - 1]);
+  psnip_random__pcg_jump(16, &multiplier, &increment);
+
+  s0 = _mm256_loadu_si256((const __m256i*) &(lanes[0]));
+  s1 = _mm256_loadu_si256((const __m256i*) &(lanes[8]));
+  m = _mm256_set1_epi32((int) multiplier);
+  p = _mm256_set1_epi32((int) increment);
+
+  for (offset = 0 ; (length - offset) >= sizeof(lanes) ; offset += sizeof(lanes)) {
+    _mm256_storeu_si256((__m256i*) &(data[offset]),      psnip_random__pcg_from_state_avx2(s0));
+    _mm256_storeu_si256((__m256i*) &(data[offset + 32]), psnip_random__pcg_from_state_avx2(s1));
+    s0 = _mm256_add_epi32(_mm256_mullo_epi32(s0, m), p);
+    s1 = _mm256_add_epi32(_mm256_mullo_epi32(s1, m), p);
+  }
+
+  _mm256_storeu_si256((__m256i*) &(lanes[0]), s0);
+  *state = lanes[0];
+  return offset;
+}
+#endif
+
+#if defined(PSNIP_RANDOM__SSE2)
+PSNIP_RANDOM__SSE2_ATTRIBUTES
+static __m128i
+psnip_random__mullo_epi32_sse2(__m128i a, __m128i b) {
+  const __m128i even = _mm_mul_epu32(a, b);
+  const __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+
+  return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+			    _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+/* Shift each lane of res right by 1, 2, 4 and 8 bits if the
+ * corresponding bit (28 to 31) of the lane of state is set. */
+#define PSNIP_RANDOM__SSE_SHIFT_STEP(res, state, bit, n) \
+  do { \
+    const __m128i mask_ = _mm_srai_epi32(_mm_slli_epi32(state, 31 - (bit)), 31); \
+    res = _mm_or_si128(_mm_and_si128(mask_, _mm_srli_epi32(res, n)), _mm_andnot_si128(mask_, res)); \
+  } while (0)
+
+/* The SSE2 and SSE4.1 versions only differ in how they multiply, so
+ * this is expanded once for each.  SSE has no per-lane shift, so
+ * state >> ((state >> 28) + 4) is built up one bit of the shift at a
+ * time. */
+#define PSNIP_RANDOM__PCG_FILL_SSE(isa, attributes, mullo) \
+  attributes \
+  static __m128i \
+  psnip_random__pcg_from_state_##isa(__m128i state) { \
+    __m128i res = _mm_srli_epi32(state, 4); \
+    PSNIP_RANDOM__SSE_SHIFT_STEP(res, state, 28, 1); \
+    PSNIP_RANDOM__SSE_SHIFT_STEP(res, state, 29, 2); \
+    PSNIP_RANDOM__SSE_SHIFT_STEP(res, state, 30, 4); \
+    PSNIP_RANDOM__SSE_SHIFT_STEP(res, state, 31, 8); \
+    res = mullo(_mm_xor_si128(res, state), _mm_set1_epi32(277803737)); \
+    return _mm_xor_si128(res, _mm_srli_epi32(res, 22)); \
+  } \
+  \
+  attributes \
+  static size_t \
+  psnip_random__pcg_fill_##isa(psnip_uint32_t* state, size_t length, psnip_uint8_t data[PSNIP_RANDOM_ARRAY_PARAM(length)]) { \
+    psnip_uint32_t lanes[8]; \
+    psnip_uint32_t multiplier, increment; \
+    __m128i s0, s1, m, p; \
+    size_t offset, i; \
+    \
+    lanes[0] = *state; \
+    for (i = 1 ; i < 8 ; i++) \
+      lanes[i] = psnip_random__pcg_next_state(lanes[i - 1]); \
+    psnip_random__pcg_jump(8, &multiplier, &increment); \
+    \
+    s0 = _mm_loadu_si128((const __m128i*) &(lanes[0])); \
+    s1 = _mm_loadu_si128((const __m128i*) &(lanes[4])); \
+    m = _mm_set1_epi32((int) multiplier); \
+    p = _mm_set1_epi32((int) increment); \
+    \
+    for (offset = 0 ; (length - offset) >= sizeof(lanes) ; offset += sizeof(lanes)) { \
+      _mm_storeu_si128((__m128i*) &(data[offset]),      psnip_random__pcg_from_state_##isa(s0)); \
+      _mm_storeu_si128((__m128i*) &(data[offset + 16]), psnip_random__pcg_from_state_##isa(s1)); \
+      s0 = _mm_add_epi32(mullo(s0, m), p); \
+      s1 = _mm_add_epi32(mullo(s1, m), p); \
+    } \
+    \
+    _mm_storeu_si128((__m128i*) &(lanes[0]), s0); \
+    *state = lanes[0]; \
+    return offset; \
+  }
+
+PSNIP_RANDOM__PCG_FILL_SSE(sse2, PSNIP_RANDOM__SSE2_ATTRIBUTES, psnip_random__mullo_epi32_sse2)
+#if defined(PSNIP_RANDOM__SSE4_1)
+PSNIP_RANDOM__PCG_FILL_SSE(sse4_1, PSNIP_RANDOM__SSE4_1_ATTRIBUTES, _mm_mullo_epi32)
+#endif
+#endif
+
+#if defined(PSNIP_RANDOM__NEON)
+static uint32x4_t
+psnip_random__pcg_from_state_neon(uint32x4_t state) {
+  uint32x4_t res;
+
+  /* A negative shift count shifts right. */
+  res = vshlq_u32(state, vnegq_s32(vreinterpretq_s32_u32(vaddq_u32(vshrq_n_u32(state, 28), vdupq_n_u32(4)))));
+  res = vmulq_u32(veorq_u32(res, state), vdupq_n_u32(277803737U));
+  return veorq_u32(res, vshrq_n_u32(res, 22));
+}
+
+static size_t
+psnip_random__pcg_fill_neon(psnip_uint32_t* state, size_t length, psnip_uint8_t data[PSNIP_RANDOM_ARRAY_PARAM(length)]) {
+  psnip_uint32_t lanes[8];
+  psnip_uint32_t multiplier, increment;
+  uint32x4_t s0, s1, m, p;
+  size_t offset, i;
+
+  lanes[0] = *state;
+  for (i = 1 ; i < 8 ; i++)
+    lanes[i] = psnip_random__pcg_next_state(lanes[i - 1]);
+  psnip_random__pcg_jump(8, &multiplier, &increment);
+
+  s0 = vld1q_u32(&(lanes[0]));
+  s1 = vld1q_u32(&(lanes[4]));
+  m = vdupq_n_u32(multiplier);
+  p = vdupq_n_u32(increment);
+
+  for (offset = 0 ; (length - offset) >= sizeof(lanes) ; offset += sizeof(lanes)) {
+    vst1q_u8(&(data[offset]),      vreinterpretq_u8_u32(psnip_random__pcg_from_state_neon(s0)));
+    vst1q_u8(&(data[offset + 16]), vreinterpretq_u8_u32(psnip_random__pcg_from_state_neon(s1)));
+    s0 = vmlaq_u32(p, s0, m);
+    s1 = vmlaq_u32(p, s1, m);
+  }
+
+  vst1q_u32(&(lanes[0]), s0);
+  *state = lanes[0];
+  return offset;
+}
+#endif
+
+/* Fill the buffer starting from state, returning the state following
+ * the last value generated. */
+static psnip_uint32_t
+psnip_random__pcg_fill(psnip_uint32_t state, size_t length, psnip_uint8_t data[PSNIP_RANDOM_ARRAY_PARAM(length)]) {
+  psnip_uint32_t v;
+  size_t offset = 0;
+  size_t remaining;
+
+  if (length >= PSNIP_RANDOM__BULK_MIN_LENGTH) {
+#if defined(PSNIP_RANDOM__AVX2)
+    if (psnip_cpu_feature_check(PSNIP_CPU_FEATURE_X86_AVX2))
+      offset = psnip_random__pcg_fill_avx2(&state, length, data);
+    else
+#endif
+#if defined(PSNIP_RANDOM__SSE4_1)
+    if (psnip_cpu_feature_check(PSNIP_CPU_FEATURE_X86_SSE4_1))
+      offset = psnip_random__pcg_fill_sse4_1(&state, length, data);
+    else
+#endif
+#if defined(PSNIP_RANDOM__SSE2)
+    if (psnip_cpu_feature_check(PSNIP_CPU_FEATURE_X86_SSE2))
+      offset = psnip_random__pcg_fill_sse2(&state, length, data);
+    else
+#endif
+#if defined(PSNIP_RANDOM__NEON)
+      offset = psnip_random__pcg_fill_neon(&state, length, data);
+#else
+      offset = psnip_random__pcg_fill_lanes(&state, length, data);
+#endif
+  }
+
+  remaining = length - offset;
+  while (remaining > 0) {
+    v = psnip_random__pcg_from_state(state);
+    state = psnip_random__pcg_next_state(state);
+
+    if (remaining >= sizeof(psnip_uint32_t)) {
+      memcpy(&(data[length - remaining]), &v, sizeof(psnip_uint32_t));
+      remaining -= sizeof(psnip_uint32_t);
+    } else {
+      memcpy(&(data[length - remaining]), &v, remaining);
+      remaining = 0;
+    }
+  }
+
+  return state;
+}
+
 static int
 psnip_random__pgc_generate(psnip_atomic_int32* state, size_t length, psnip_uint8_t data[PSNIP_RANDOM_ARRAY_PARAM(length)]) {
   psnip_int32_t old_state;
-  psnip_uint32_t new_state, v;
-  size_t remaining;
+  psnip_uint32_t new_state;
 
   do {
     old_state = psnip_atomic_int32_load(state);
-    new_state = (psnip_uint32_t) old_state;
-
-    remaining = length;
-    while (remaining > 0) {
-      v = psnip_random__pcg_from_state(new_state);
-      new_state = psnip_random__pcg_next_state(new_state);
-
-      if (remaining >= sizeof(psnip_uint32_t)) {
-	memcpy(&(data[length - remaining]), &v, sizeof(psnip_uint32_t));
-	remaining -= sizeof(psnip_uint32_t);
-      } else {
-	memcpy(&(data[length - remaining]), &v, remaining);
-	remaining = 0;
-      }
-    }
+    new_state = psnip_random__pcg_fill((psnip_uint32_t) old_state, length, data);
   } while (!psnip_atomic_int32_compare_exchange(state, &old_state, (psnip_int32_t) new_state));
 
   return 0;
 }
 
+/* PCG with a 64-bit state
+ *
+ * This uses the same LCG as Knuth's MMIX, and the RXS M XS output
+ * function (see random.h), so we get a period of 2^64 and 64 bits of
+ * output for each step instead of the 2^32 period and 32-bit output
+ * of the generator above. */
+
+/* Compute the multiplier and increment which advance the LCG by delta
+ * steps at once, in O(log delta) time.  See Forrest B. Brown, "Random
+ * Number Generation with Arbitrary Stride", Trans. Am. Nucl. Soc. (Nov.
+ * 1994). */
+static void
+psnip_random__pcg64_jump(psnip_uint64_t delta, psnip_uint64_t increment,
+			 psnip_uint64_t* multiplier_out, psnip_uint64_t* increment_out) {
+  psnip_uint64_t acc_mult = 1, acc_plus = 0;
+  psnip_uint64_t cur_mult = PSNIP_RANDOM__PCG64_MULTIPLIER, cur_plus = increment;
+
+  while (delta > 0) {
+    if (delta & 1) {
+      acc_mult *= cur_mult;
+      acc_plus = acc_plus * cur_mult + cur_plus;
+    }
+    cur_plus = (cur_mult + 1) * cur_plus;
+    cur_mult *= cur_mult;
+    delta >>= 1;
+  }
+
+  *multiplier_out = acc_mult;
+  *increment_out = acc_plus;
+}
+
+#define PSNIP_RANDOM__PCG64_LANES 4
+
+static size_t
+psnip_random__pcg64_fill_lanes(struct PSnipRandomGenerator* generator, size_t length, psnip_uint8_t data[PSNIP_RANDOM_ARRAY_PARAM(length)]) {
+  psnip_uint64_t lanes[PSNIP_RANDOM__PCG64_LANES], v[PSNIP_RANDOM__PCG64_LANES];
+  psnip_uint64_t multiplier, increment;
+  size_t offset, i;
+
+  lanes[0] = generator->state;
+  for (i = 1 ; i < PSNIP_RANDOM__PCG64_LANES ; i++)
+    lanes[i] = psnip_random__pcg64_next_state(lanes[i - 1], generator->increment);
+  psnip_random__pcg64_jump(PSNIP_RANDOM__PCG64_LANES, generator->increment, &multiplier, &increment);
+
+  for (offset = 0 ; (length - offset) >= sizeof(v) ; offset += sizeof(v)) {
+    for (i = 0 ; i < PSNIP_RANDOM__PCG64_LANES ; i++) {
+      v[i] = psnip_random__pcg64_from_state(lanes[i]);
+      lanes[i] = lanes[i] * multiplier + increment;
+    }
+    memcpy(&(data[offset]), v, sizeof(v));
+  }
+
+  generator->state = lanes[0];
+  return offset;
+}
+
+#if defined(PSNIP_RANDOM__AVX2)
+/* AVX2 doesn't have a 64-bit multiply, so build one out of 32-bit
+ * multiplies; we only need the low 64 bits of the product. */
+PSNIP_RANDOM__AVX2_ATTRIBUTES
+static __m256i
+psnip_random__mullo_epi64_avx2(__m256i a, __m256i b) {
+  const __m256i lo = _mm256_mul_epu32(a, b);
+  const __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+					 _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+  return _mm256_add_epi64(lo, _mm256_slli_epi64(cross, 32));
+}
+
+PSNIP_RANDOM__AVX2_ATTRIBUTES
+static __m256i
+psnip_random__pcg64_from_state_avx2(__m256i state) {
+  __m256i res;
+
+  res = _mm256_srlv_epi64(state, _mm256_add_epi64(_mm256_srli_epi64(state, 59), _mm256_set1_epi64x(5)));
+  res = psnip_random__mullo_epi64_avx2(_mm256_xor_si256(res, state), _mm256_set1_epi64x((long long) 12605985483714917081ULL));
+  return _mm256_xor_si256(res, _mm256_srli_epi64(res, 43));
+}
+
+PSNIP_RANDOM__AVX2_ATTRIBUTES
+static size_t
+psnip_random__pcg64_fill_avx2(struct PSnipRandomGenerator* generator, size_t length, psnip_uint8_t data[PSNIP_RANDOM_ARRAY_PARAM(length)]) {
+  psnip_uint64_t lanes[8];
+  psnip_uint64_t multiplier, increment;
+  __m256i s0, s1, m, p;
+  size_t offset, i;
+
+  lanes[0] = generator->state;
+  for (i = 1 ; i < 8 ; i++)
+    lanes[i] = psnip_random__pcg64_next_state(lanes[i - 1], generator->increment);
+  psnip_random__pcg64_jump(8, generator->increment, &multiplier, &increment);
+
+  s0 = _mm256_loadu_si256((const __m256i*) &(lanes[0]));
+  s1 = _mm256_loadu_si256((const __m256i*) &(lanes[4]));
+  m = _mm256_set1_epi64x((long long) multiplier);
+  p = _mm256_set1_epi64x((long long) increment);
+
+  for (offset = 0 ; (length - offset) >= sizeof(lanes) ; offset += sizeof(lanes)) {
+    _mm256_storeu_si256((__m256i*) &(data[offset]),      psnip_random__pcg64_from_state_avx2(s0));
+    _mm256_storeu_si256((__m256i*) &(data[offset + 32]), psnip_random__pcg64_from_state_avx2(s1));
+    s0 = _mm256_add_epi64(psnip_random__mullo_epi64_avx2(s0, m), p);
+    s1 = _mm256_add_epi64(psnip_random__mullo_epi64_avx2(s1, m), p);
+  }
+
+  _mm256_storeu_si256((__m256i*) &(lanes[0]), s0);
+  generator->state = lanes[0];
+  return offset;
+}
+#endif
+
+static void
+psnip_random__pcg64_fill(struct PSnipRandomGenerator* generator, size_t length, psnip_uint8_t data[PSNIP_RANDOM_ARRAY_PARAM(length)]) {
+  psnip_uint64_t v, state;
+  size_t offset = 0;
+  size_t remaining;
+
+  if (length >= PSNIP_RANDOM__BULK_MIN_LENGTH) {
+#if defined(PSNIP_RANDOM__AVX2)
+    if (psnip_cpu_feature_check(PSNIP_CPU_FEATURE_X86_AVX2))
+      offset = psnip_random__pcg64_fill_avx2(generator, length, data);
+    else
+#endif
+      offset = psnip_random__pcg64_fill_lanes(generator, length, data);
+  }
+
+  state = generator->state;
+  remaining = length - offset;
+  while (remaining > 0) {
+    v = psnip_random__pcg64_from_state(state);
+    state = psnip_random__pcg64_next_state(state, generator->increment);
+
+    if (remaining >= sizeof(psnip_uint64_t)) {
+      memcpy(&(data[length - remaining]), &v, sizeof(psnip_uint64_t));
+      remaining -= sizeof(psnip_uint64_t);
+    } else {
+      memcpy(&(data[length - remaining]), &v, remaining);
+      remaining = 0;
+    }
+  }
+
+  generator->state = state;
+}
+
+static psnip_uint64_t
+psnip_random__pcg64_gen_seed(const void* salt) {
+  psnip_uint64_t seed;
+
+  seed  = ((psnip_uint64_t) psnip_random__pcg_gen_seed()) << 32;
+  seed |= (psnip_uint64_t) psnip_random__seed_hash((psnip_uint32_t) (size_t) salt);
+
+  return psnip_random__pcg64_next_state(seed, PSNIP_RANDOM__PCG64_INCREMENT);
+}
+
+/* Counter-based
+ *
+ * Philox4x32-10 (Salmon et al., "Parallel Random Numbers: As Easy as
+ * 1, 2, 3", SC '11).  Each 16-byte block of output is a keyed
+ * bijection of its 64-bit block index, so any part of the stream can
+ * be generated without touching what comes before it, and blocks are
+ * independent of each other, which makes it easy to vectorize. */
+
+#define PSNIP_RANDOM__PHILOX_M0 0xD2511F53U
+#define PSNIP_RANDOM__PHILOX_M1 0xCD9E8D57U
+#define PSNIP_RANDOM__PHILOX_W0 0x9E3779B9U
+#define PSNIP_RANDOM__PHILOX_W1 0xBB67AE85U
+#define PSNIP_RANDOM__PHILOX_ROUNDS 10
+#define PSNIP_RANDOM__PHILOX_BLOCK_SIZE 16
+
+static void
+psnip_random__philox_block(psnip_uint64_t key, psnip_uint64_t counter, psnip_uint32_t block[4]) {
+  psnip_uint32_t c0 = (psnip_uint32_t) counter;
+  psnip_uint32_t c1 = (psnip_uint32_t) (counter >> 32);
+  psnip_uint32_t c2 = 0, c3 = 0;
+  psnip_uint32_t k0 = (psnip_uint32_t) key;
+  psnip_uint32_t k1 = (psnip_uint32_t) (key >> 32);
+  psnip_uint64_t p0, p1;
+  int i;
+
+  for (i = 0 ; i < PSNIP_RANDOM__PHILOX_ROUNDS ; i++) {
+    p0 = ((psnip_uint64_t) PSNIP_RANDOM__PHILOX_M0) * c0;
+    p1 = ((psnip_uint64_t) PSNIP_RANDOM__PHILOX_M1) * c2;
+    c0 = ((psnip_uint32_t) (p1 >> 32)) ^ c1 ^ k0;
+    c1 = (psnip_uint32_t) p1;
+    c2 = ((psnip_uint32_t) (p0 >> 32)) ^ c3 ^ k1;
+    c3 = (psnip_uint32_t) p0;
+    k0 += PSNIP_RANDOM__PHILOX_W0;
+    k1 += PSNIP_RANDOM__PHILOX_W1;
+  }
+
+  block[0] = c0;
+  block[1] = c1;
+  block[2] = c2;
+  block[3] = c3;
+}
+
+#if defined(PSNIP_RANDOM__AVX2)
+/* Low and high halves of a 32x32-bit multiplication in each of the 8
+ * lanes. */
+PSNIP_RANDOM__AVX2_ATTRIBUTES
+static __m256i
+psnip_random__philox_mulhilo_avx2(__m256i a, __m256i m, __m256i* hi) {
+  const __m256i even = _mm256_mul_epu32(a, m);
+  const __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), m);
+
+  *hi = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+  return _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA);
+}
+
+/* Eight blocks at a time, one per 32-bit lane, transposed back into
+ * stream order on the way out.  Returns the number of bytes
+ * generated, which is a multiple of 128. */
+PSNIP_RANDOM__AVX2_ATTRIBUTES
+static size_t
+psnip_random__philox_fill_avx2(psnip_uint64_t key, psnip_uint64_t counter, size_t length, psnip_uint8_t data[PSNIP_RANDOM_ARRAY_PARAM(length)]) {
+  const __m256i m0 = _mm256_set1_epi32((int) PSNIP_RANDOM__PHILOX_M0);
+  const __m256i m1 = _mm256_set1_epi32((int) PSNIP_RANDOM__PHILOX_M1);
+  const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256i c0, c1, c2, c3, k0, k1, lo0, hi0, lo1, hi1, t0, t1, t2, t3;
+  psnip_uint32_t block[4];
+  size_t offset, i;
+  int r;
+
+  for (offset = 0 ; (length - offset) >= (8 * PSNIP_RANDOM__PHILOX_BLOCK_SIZE) ; offset += 8 * PSNIP_RANDOM__PHILOX_BLOCK_SIZE, counter += 8) {
+    if (((psnip_uint32_t) counter) > (0xFFFFFFFFU - 7)) {
+      /* The low word of the counter wraps within this group; this
+       * happens once every 2^32 blocks, so don't bother vectorizing
+       * the carry. */
+      for (i = 0 ; i < 8 ; i++) {
+	psnip_random__philox_block(key, counter + i, block);
+	memcpy(&(data[offset + (i * PSNIP_RANDOM__PHILOX_BLOCK_SIZE)]), block, sizeof(block));
+      }
+      continue;
+    }
+
+    c0 = _mm256_add_epi32(_mm256_set1_epi32((int) (psnip_uint32_t) counter), lanes);
+    c1 = _mm256_set1_epi32((int) (psnip_uint32_t) (counter >> 32));
+    c2 = _mm256_setzero_si256();
+    c3 = _mm256_setzero_si256();
+    k0 = _mm256_set1_epi32((int) (psnip_uint32_t) key);
+    k1 = _mm256_set1_epi32((int) (psnip_uint32_t) (key >> 32));
+
+    for (r = 0 ; r < PSNIP_RANDOM__PHILOX_ROUNDS ; r++) {
+      lo0 = psnip_random__philox_mulhilo_avx2(c0, m0, &hi0);
+      lo1 = psnip_random__philox_mulhilo_avx2(c2, m1, &hi1);
+      c0 = _mm256_xor_si256(_mm256_xor_si256(hi1, c1), k0);
+      c1 = lo1;
+      c2 = _mm256_xor_si256(_mm256_xor_si256(hi0, c3), k1);
+      c3 = lo0;
+      k0 = _mm256_add_epi32(k0, _mm256_set1_epi32((int) PSNIP_RANDOM__PHILOX_W0));
+      k1 = _mm256_add_epi32(k1, _mm256_set1_epi32((int) PSNIP_RANDOM__PHILOX_W1));
+    }
+
+    /* 4x8 transpose; afterwards t0 = blocks 0 and 4, t1 = 1 and 5,
+     * t2 = 2 and 6, t3 = 3 and 7. */
+    lo0 = _mm256_unpacklo_epi32(c0, c1);
+    lo1 = _mm256_unpacklo_epi32(c2, c3);
+    hi0 = _mm256_unpackhi_epi32(c0, c1);
+    hi1 = _mm256_unpackhi_epi32(c2, c3);
+    t0 = _mm256_unpacklo_epi64(lo0, lo1);
+    t1 = _mm256_unpackhi_epi64(lo0, lo1);
+    t2 = _mm256_unpacklo_epi64(hi0, hi1);
+    t3 = _mm256_unpackhi_epi64(hi0, hi1);
+
+    _mm256_storeu_si256((__m256i*) &(data[offset]),      _mm256_permute2x128_si256(t0, t1, 0x20));
+    _mm256_storeu_si256((__m256i*) &(data[offset + 32]), _mm256_permute2x128_si256(t2, t3, 0x20));
+    _mm256_storeu_si256((__m256i*) &(data[offset + 64]), _mm256_permute2x128_si256(t0, t1, 0x31));
+    _mm256_storeu_si256((__m256i*) &(data[offset + 96]), _mm256_permute2x128_si256(t2, t3, 0x31));
+  }
+
+  return offset;
+}
+#endif
+
+void
+psnip_random_counter_bytes (psnip_uint64_t key,
+			    psnip_uint64_t offset,
+			    size_t length,
+			    psnip_uint8_t data[PSNIP_RANDOM_ARRAY_PARAM(length)]) {
+  psnip_uint64_t counter = offset / PSNIP_RANDOM__PHILOX_BLOCK_SIZE;
+  const size_t skip = (size_t) (offset % PSNIP_RANDOM__PHILOX_BLOCK_SIZE);
+  psnip_uint32_t block[4];
+  size_t n;
+
+  /* Leading partial block */
+  if (skip != 0 && length > 0) {
+    psnip_random__philox_block(key, counter++, block);
+    n = (PSNIP_RANDOM__PHILOX_BLOCK_SIZE - skip) < length ? (PSNIP_RANDOM__PHILOX_BLOCK_SIZE - skip) : length;
+    memcpy(data, ((psnip_uint8_t*) block) + skip, n);
+    data += n;
+    length -= n;
+  }
+
+#if defined(PSNIP_RANDOM__AVX2)
+  /* Unlike PCG there is no setup cost for the vector path, so it's
+   * worth using as soon as there is a full group of blocks. */
+  if (length >= (8 * PSNIP_RANDOM__PHILOX_BLOCK_SIZE) && psnip_cpu_feature_check(PSNIP_CPU_FEATURE_X86_AVX2)) {
+    n = psnip_random__philox_fill_avx2(key, counter, length, data);
+    counter += n / PSNIP_RANDOM__PHILOX_BLOCK_SIZE;
+    data += n;
+    length -= n;
+  }
+#endif
+
+  while (length > 0) {
+    psnip_random__philox_block(key, counter++, block);
+    n = length < sizeof(block) ? length : sizeof(block);
+    memcpy(data, block, n);
+    data += n;
+    length -= n;
+  }
+}
+
 /* Reproducible */
 
 static psnip_atomic_int32 psnip_random__reproducible_seed = 0;
 static psnip_atomic_int32 psnip_random__reproducible_state = 0;
+/* Byte offset into the counter-based stream; reset with the seed. */
+static psnip_atomic_int64 psnip_random__counter_position = 0;
 static psnip_once psnip_random_reproducible_once = PSNIP_ONCE_INIT;
 
 static void
@@ -345,6 +1350,7 @@ psnip_random_set_seed (psnip_uint32_t seed) {
 
   psnip_atomic_int32_store(&psnip_random__reproducible_seed, sseed);
   psnip_atomic_int32_store(&psnip_random__reproducible_state, sseed);
+  psnip_atomic_int64_store(&psnip_random__counter_position, 0);
 }
 
 psnip_uint32_t
@@ -354,18 +1360,96 @@ psnip_random_get_seed (void) {
   return (psnip_uint32_t) psnip_atomic_int32_load(&psnip_random__reproducible_seed);
 }
 
+/* The counter source is keyed by the reproducible seed.  Each request
+ * just reserves its range of the stream with an atomic add, so
+ * concurrent callers never retry, and the output for a given range
+ * does not depend on how the requests were split up. */
+static int
+psnip_random__counter_generate(size_t length, psnip_uint8_t data[PSNIP_RANDOM_ARRAY_PARAM(length)]) {
+  psnip_uint64_t key, offset;
+
+  psnip_once_call(&psnip_random_reproducible_once, &psnip_random_reproducible_init);
+
+  key = (psnip_uint64_t) (psnip_uint32_t) psnip_atomic_int32_load(&psnip_random__reproducible_seed);
+  offset = (psnip_uint64_t) psnip_atomic_int64_add(&psnip_random__counter_position, (psnip_int64_t) length);
+
+  psnip_random_counter_bytes(key, offset, length, data);
+
+  return 0;
+}
+
 /* Fast */
 
-static psnip_atomic_int32 psnip_random__fast_state = 0;
+#if defined(PSNIP_RANDOM__THREAD_LOCAL)
+/* Each thread gets its own generator, so there is no contention
+ * between threads and no need for atomic operations.  The generator
+ * is seeded lazily the first time a thread asks for data, and again
+ * if the process forks; the address of the thread-local state is
+ * mixed in so threads which are seeded at the same time still end up
+ * with different streams, and the seed includes the PID so children
+ * of the same parent do too. */
+static PSNIP_RANDOM__THREAD_LOCAL struct PSnipRandomGenerator psnip_random__fast_generator = { 0, 0 };
+static PSNIP_RANDOM__THREAD_LOCAL int psnip_random__fast_seeded = 0;
+static PSNIP_RANDOM__THREAD_LOCAL psnip_int32_t psnip_random__fast_generation = 0;
+
+static void
+psnip_random_fast_init(void) {
+  psnip_random__fast_generator.state = psnip_random__pcg64_gen_seed(&psnip_random__fast_generator);
+  psnip_random__fast_generator.increment = PSNIP_RANDOM__PCG64_INCREMENT;
+  psnip_random__fast_generation = psnip_random__fork_generation_get();
+  psnip_random__fast_seeded = 1;
+}
+
+static int
+psnip_random__fast_generate(size_t length, psnip_uint8_t data[PSNIP_RANDOM_ARRAY_PARAM(length)]) {
+#if !defined(PSNIP_RANDOM_FAST_NO_INIT)
+  if (!psnip_random__fast_seeded || psnip_random__fast_generation != psnip_random__fork_generation_get())
+    psnip_random_fast_init();
+#endif
+
+  psnip_random__pcg64_fill(&psnip_random__fast_generator, length, data);
+
+  return 0;
+}
+#else
+static psnip_atomic_int64 psnip_random__fast_state = 0;
+static psnip_atomic_int32 psnip_random__fast_generation = 0;
 static psnip_once psnip_random_fast_once = PSNIP_ONCE_INIT;
 
 static void
 psnip_random_fast_init(void) {
-  psnip_int32_t seed = (psnip_int32_t) psnip_random__pcg_gen_seed();
+  psnip_int64_t seed = (psnip_int64_t) psnip_random__pcg64_gen_seed(&psnip_random__fast_state);
 
-  psnip_atomic_int32_store((psnip_atomic_int32*) &psnip_random__fast_state, seed);
+  psnip_atomic_int64_store(&psnip_random__fast_state, seed);
+  psnip_atomic_int32_store(&psnip_random__fast_generation, psnip_random__fork_generation_get());
 }
 
+static int
+psnip_random__fast_generate(size_t length, psnip_uint8_t data[PSNIP_RANDOM_ARRAY_PARAM(length)]) {
+  psnip_int64_t old_state;
+  struct PSnipRandomGenerator generator;
+
+#if !defined(PSNIP_RANDOM_FAST_NO_INIT)
+  psnip_once_call(&psnip_random_fast_once, &psnip_random_fast_init);
+
+  /* Only the forking thread survives in the child, so there is no
+   * race here unless new threads are started before the first
+   * request, and then the worst case is reseeding twice. */
+  if (psnip_atomic_int32_load(&psnip_random__fast_generation) != psnip_random__fork_generation_get())
+    psnip_random_fast_init();
+#endif
+
+  generator.increment = PSNIP_RANDOM__PCG64_INCREMENT;
+  do {
+    old_state = psnip_atomic_int64_load(&psnip_random__fast_state);
+    generator.state = (psnip_uint64_t) old_state;
+    psnip_random__pcg64_fill(&generator, length, data);
+  } while (!psnip_atomic_int64_compare_exchange(&psnip_random__fast_state, &old_state, (psnip_int64_t) generator.state));
+
+  return 0;
+}
+#endif
+
 int
 psnip_random_bytes(enum PSnipRandomSource source,
 		   size_t length,
@@ -379,6 +1463,11 @@ psnip_random_bytes(enum PSnipRandomSource source,
 	return -1;
 #endif
 
+#if defined(PSNIP_RANDOM__SECURE_POOL)
+      if (length > 0 && length <= PSNIP_RANDOM__SECURE_POOL_MAX_REQUEST)
+	return psnip_random__secure_pool_generate(length, data);
+#endif
+
       return psnip_random_secure_generate(length, data);
 
     case PSNIP_RANDOM_SOURCE_REPRODUCIBLE:
@@ -389,12 +1478,506 @@ psnip_random_bytes(enum PSnipRandomSource source,
       return psnip_random__pgc_generate(&psnip_random__reproducible_state, length, data);
 
     case PSNIP_RANDOM_SOURCE_FAST:
-#if !defined(PSNIP_RANDOM_FAST_NO_INIT)
-      psnip_once_call(&psnip_random_fast_once, &psnip_random_fast_init);
-#endif
+      return psnip_random__fast_generate(length, data);
 
-      return psnip_random__pgc_generate(&psnip_random__fast_state, length, data);
+    case PSNIP_RANDOM_SOURCE_HARDWARE:
+      return psnip_random__hardware_generate(length, data);
+
+    case PSNIP_RANDOM_SOURCE_COUNTER:
+      return psnip_random__counter_generate(length, data);
   }
 
   return -2;
 }
+
+/* Generator objects */
+
+static void
+psnip_random__generator_seed (struct PSnipRandomGenerator* generator, psnip_uint64_t seed, psnip_uint64_t increment) {
+  assert(generator != NULL);
+
+  generator->increment = increment;
+  generator->state = psnip_random__pcg64_next_state(0, generator->increment);
+  generator->state += seed;
+  generator->state = psnip_random__pcg64_next_state(generator->state, generator->increment);
+}
+
+void
+psnip_random_generator_seed (struct PSnipRandomGenerator* generator, psnip_uint64_t seed) {
+  psnip_random__generator_seed(generator, seed, PSNIP_RANDOM__PCG64_INCREMENT);
+}
+
+/* Each stream uses a different (odd) increment, so generators with the
+ * same seed but different streams produce unrelated sequences.  Only
+ * the low 63 bits of the stream are significant. */
+void
+psnip_random_generator_seed_stream (struct PSnipRandomGenerator* generator, psnip_uint64_t seed, psnip_uint64_t stream) {
+  psnip_random__generator_seed(generator, seed, (stream << 1) | 1);
+}
+
+void
+psnip_random_generator_advance (struct PSnipRandomGenerator* generator, psnip_uint64_t delta) {
+  psnip_uint64_t multiplier, increment;
+
+  assert(generator != NULL);
+
+  psnip_random__pcg64_jump(delta, generator->increment, &multiplier, &increment);
+  generator->state = generator->state * multiplier + increment;
+}
+
+int
+psnip_random_generator_init (struct PSnipRandomGenerator* generator, enum PSnipRandomSource source) {
+  psnip_uint64_t seed[2];
+  int r;
+
+  assert(generator != NULL);
+
+  r = psnip_random_bytes(source, sizeof(seed), (psnip_uint8_t*) seed);
+  if (r != 0)
+    return r;
+
+  psnip_random_generator_seed_stream(generator, seed[0], seed[1]);
+
+  return 0;
+}
+
+void
+psnip_random_generator_bytes (struct PSnipRandomGenerator* generator,
+			      size_t length,
+			      psnip_uint8_t data[PSNIP_RANDOM_ARRAY_PARAM(length)]) {
+  assert(generator != NULL);
+
+  psnip_random__pcg64_fill(generator, length, data);
+}
+
+/* Batches
+ *
+ * These produce exactly the same values as calling the single-value
+ * functions count times.  Doubles only need one 64-bit value each, so
+ * we use the bulk path to generate the raw values directly in the
+ * output buffer and then convert them in place. */
+
+void
+psnip_random_generator_fill_bounded_u32 (struct PSnipRandomGenerator* generator,
+					 psnip_uint32_t bound,
+					 size_t count,
+					 psnip_uint32_t values[PSNIP_RANDOM_ARRAY_PARAM(count)]) {
+  struct PSnipRandomGenerator g;
+  size_t i;
+
+  assert(generator != NULL);
+
+  g = *generator;
+  for (i = 0 ; i < count ; i++)
+    values[i] = psnip_random_generator_bounded_u32(&g, bound);
+  *generator = g;
+}
+
+void
+psnip_random_generator_fill_bounded_u64 (struct PSnipRandomGenerator* generator,
+					 psnip_uint64_t bound,
+					 size_t count,
+					 psnip_uint64_t values[PSNIP_RANDOM_ARRAY_PARAM(count)]) {
+  struct PSnipRandomGenerator g;
+  size_t i;
+
+  assert(generator != NULL);
+
+  g = *generator;
+  for (i = 0 ; i < count ; i++)
+    values[i] = psnip_random_generator_bounded_u64(&g, bound);
+  *generator = g;
+}
+
+void
+psnip_random_generator_fill_float (struct PSnipRandomGenerator* generator,
+				   size_t count,
+				   float values[PSNIP_RANDOM_ARRAY_PARAM(count)]) {
+  struct PSnipRandomGenerator g;
+  size_t i;
+
+  assert(generator != NULL);
+
+  g = *generator;
+  for (i = 0 ; i < count ; i++)
+    values[i] = psnip_random_generator_next_float(&g);
+  *generator = g;
+}
+
+void
+psnip_random_generator_fill_double (struct PSnipRandomGenerator* generator,
+				    size_t count,
+				    double values[PSNIP_RANDOM_ARRAY_PARAM(count)]) {
+  psnip_uint64_t v;
+  size_t i;
+
+  assert(generator != NULL);
+  assert(sizeof(double) == sizeof(psnip_uint64_t));
+
+  psnip_random__pcg64_fill(generator, count * sizeof(double), (psnip_uint8_t*) values);
+
+  for (i = 0 ; i < count ; i++) {
+    memcpy(&v, &(values[i]), sizeof(v));
+    values[i] = ((double) (v >> 11)) * (1.0 / 9007199254740992.0);
+  }
+}
+
+/* Ziggurat
+ *
+ * Normal and exponential variates using Marsaglia & Tsang's ziggurat
+ * method ("The Ziggurat Method for Generating Random Variables",
+ * Journal of Statistical Software, 2000) with 256 layers.  The layer
+ * tables are computed once, the first time they are needed.
+ *
+ * Each attempt consumes a single 64-bit value: the low 8 bits select
+ * the layer, bit 8 is the sign (normal only), and the top 53 bits are
+ * the uniform used for the x coordinate.  Around 99% of attempts are
+ * accepted by the rectangle test alone, which is just a multiply and
+ * a compare; only the wedges and the tail need exp() or log(). */
+
+#define PSNIP_RANDOM__ZIGGURAT_LAYERS 256
+
+#define PSNIP_RANDOM__NORMAL_R 3.6541528853610088
+#define PSNIP_RANDOM__NORMAL_V 0.00492867323399
+#define PSNIP_RANDOM__EXPONENTIAL_R 7.69711747013104972
+#define PSNIP_RANDOM__EXPONENTIAL_V 0.0039496598225815571993
+
+struct PSnipRandomZiggurat {
+  /* x[i] is the right edge of layer i (x[0] is the width of the base
+   * layer, which includes the tail), and f[i] is the density at
+   * x[i]. */
+  double x[PSNIP_RANDOM__ZIGGURAT_LAYERS + 1];
+  double f[PSNIP_RANDOM__ZIGGURAT_LAYERS + 1];
+};
+
+static struct PSnipRandomZiggurat psnip_random__ziggurat_normal;
+static struct PSnipRandomZiggurat psnip_random__ziggurat_exponential;
+static psnip_once psnip_random__ziggurat_once = PSNIP_ONCE_INIT;
+
+static void
+psnip_random__ziggurat_init (void) {
+  struct PSnipRandomZiggurat* z;
+  double t;
+  int i;
+
+  z = &psnip_random__ziggurat_normal;
+  z->x[1] = PSNIP_RANDOM__NORMAL_R;
+  z->f[1] = exp(-0.5 * PSNIP_RANDOM__NORMAL_R * PSNIP_RANDOM__NORMAL_R);
+  z->x[0] = PSNIP_RANDOM__NORMAL_V / z->f[1];
+  z->f[0] = 0.0;
+  for (i = 1 ; i < PSNIP_RANDOM__ZIGGURAT_LAYERS - 1 ; i++) {
+    t = (PSNIP_RANDOM__NORMAL_V / z->x[i]) + z->f[i];
+    z->x[i + 1] = (t < 1.0) ? sqrt(-2.0 * log(t)) : 0.0;
+    z->f[i + 1] = exp(-0.5 * z->x[i + 1] * z->x[i + 1]);
+  }
+  z->x[PSNIP_RANDOM__ZIGGURAT_LAYERS] = 0.0;
+  z->f[PSNIP_RANDOM__ZIGGURAT_LAYERS] = 1.0;
+
+  z = &psnip_random__ziggurat_exponential;
+  z->x[1] = PSNIP_RANDOM__EXPONENTIAL_R;
+  z->f[1] = exp(-PSNIP_RANDOM__EXPONENTIAL_R);
+  z->x[0] = PSNIP_RANDOM__EXPONENTIAL_V / z->f[1];
+  z->f[0] = 0.0;
+  for (i = 1 ; i < PSNIP_RANDOM__ZIGGURAT_LAYERS - 1 ; i++) {
+    t = (PSNIP_RANDOM__EXPONENTIAL_V / z->x[i]) + z->f[i];
+    z->x[i + 1] = (t < 1.0) ? -log(t) : 0.0;
+    z->f[i + 1] = exp(-z->x[i + 1]);
+  }
+  z->x[PSNIP_RANDOM__ZIGGURAT_LAYERS] = 0.0;
+  z->f[PSNIP_RANDOM__ZIGGURAT_LAYERS] = 1.0;
+}
+
+#define PSNIP_RANDOM__U53(v) (((double) ((v) >> 11)) * (1.0 / 9007199254740992.0))
+/* 1.0 or -1.0 depending on bit 8.  The sign is a coin toss, so a
+ * branch here would be mispredicted half the time. */
+#define PSNIP_RANDOM__SIGN(v) (1.0 - ((double) (((v) >> 7) & 2)))
+
+static double
+psnip_random__normal (struct PSnipRandomGenerator* generator) {
+  const struct PSnipRandomZiggurat* z = &psnip_random__ziggurat_normal;
+  psnip_uint64_t r;
+  unsigned int i;
+  double x, a, b;
+
+  for (;;) {
+    r = psnip_random_generator_next_u64(generator);
+    i = (unsigned int) (r & 0xff);
+    x = PSNIP_RANDOM__U53(r) * z->x[i];
+
+    if (x < z->x[i + 1])
+      return x * PSNIP_RANDOM__SIGN(r);
+
+    if (i == 0) {
+      /* Tail (x > R); Marsaglia's method.  1 - u is in (0, 1], so
+       * log() is always finite. */
+      do {
+	a = -log(1.0 - psnip_random_generator_next_double(generator)) / PSNIP_RANDOM__NORMAL_R;
+	b = -log(1.0 - psnip_random_generator_next_double(generator));
+      } while ((b + b) < (a * a));
+      x = PSNIP_RANDOM__NORMAL_R + a;
+      return x * PSNIP_RANDOM__SIGN(r);
+    }
+
+    /* Wedge */
+    if ((z->f[i] + (psnip_random_generator_next_double(generator) * (z->f[i + 1] - z->f[i]))) < exp(-0.5 * x * x))
+      return x * PSNIP_RANDOM__SIGN(r);
+  }
+}
+
+static double
+psnip_random__exponential (struct PSnipRandomGenerator* generator) {
+  const struct PSnipRandomZiggurat* z = &psnip_random__ziggurat_exponential;
+  psnip_uint64_t r;
+  unsigned int i;
+  double x;
+
+  for (;;) {
+    r = psnip_random_generator_next_u64(generator);
+    i = (unsigned int) (r & 0xff);
+    x = PSNIP_RANDOM__U53(r) * z->x[i];
+
+    if (x < z->x[i + 1])
+      return x;
+
+    /* The exponential distribution is memoryless, so the tail is
+     * just R plus another exponential variate. */
+    if (i == 0)
+      return PSNIP_RANDOM__EXPONENTIAL_R - log(1.0 - psnip_random_generator_next_double(generator));
+
+    if ((z->f[i] + (psnip_random_generator_next_double(generator) * (z->f[i + 1] - z->f[i]))) < exp(-x))
+      return x;
+  }
+}
+
+double
+psnip_random_generator_next_normal (struct PSnipRandomGenerator* generator) {
+  assert(generator != NULL);
+
+  psnip_once_call(&psnip_random__ziggurat_once, &psnip_random__ziggurat_init);
+
+  return psnip_random__normal(generator);
+}
+
+double
+psnip_random_generator_next_exponential (struct PSnipRandomGenerator* generator) {
+  assert(generator != NULL);
+
+  psnip_once_call(&psnip_random__ziggurat_once, &psnip_random__ziggurat_init);
+
+  return psnip_random__exponential(generator);
+}
+
+void
+psnip_random_generator_fill_normal (struct PSnipRandomGenerator* generator,
+				    size_t count,
+				    double values[PSNIP_RANDOM_ARRAY_PARAM(count)]) {
+  struct PSnipRandomGenerator g;
+  size_t i;
+
+  assert(generator != NULL);
+
+  psnip_once_call(&psnip_random__ziggurat_once, &psnip_random__ziggurat_init);
+
+  g = *generator;
+  for (i = 0 ; i < count ; i++)
+    values[i] = psnip_random__normal(&g);
+  *generator = g;
+}
+
+void
+psnip_random_generator_fill_exponential (struct PSnipRandomGenerator* generator,
+					 size_t count,
+					 double values[PSNIP_RANDOM_ARRAY_PARAM(count)]) {
+  struct PSnipRandomGenerator g;
+  size_t i;
+
+  assert(generator != NULL);
+
+  psnip_once_call(&psnip_random__ziggurat_once, &psnip_random__ziggurat_init);
+
+  g = *generator;
+  for (i = 0 ; i < count ; i++)
+    values[i] = psnip_random__exponential(&g);
+  *generator = g;
+}
+
+/* Shuffling and sampling */
+
+/* Two bounded integers from a single 64-bit value, using the
+ * mixed-radix extension of Lemire's method from Brackett-Rozinsky &
+ * Lemire, "Batched Ranged Random Integer Generation" (2024).  This
+ * halves the number of random values (and usually of multiplications
+ * on the critical path) a shuffle needs.  The product of the bounds
+ * must fit in 64 bits. */
+PSNIP_RANDOM__FUNCTION void
+psnip_random__bounded_pair(struct PSnipRandomGenerator* generator,
+			   psnip_uint64_t bound0, psnip_uint64_t bound1,
+			   psnip_uint64_t* r0, psnip_uint64_t* r1) {
+  const psnip_uint64_t product = bound0 * bound1;
+  psnip_uint64_t x, t;
+
+  x = psnip_random__mul64(psnip_random_generator_next_u64(generator), bound0, r0);
+  x = psnip_random__mul64(x, bound1, r1);
+
+  if (x < product) {
+    t = (0 - product) % product;
+    while (x < t) {
+      x = psnip_random__mul64(psnip_random_generator_next_u64(generator), bound0, r0);
+      x = psnip_random__mul64(x, bound1, r1);
+    }
+  }
+}
+
+static void
+psnip_random__swap(psnip_uint8_t* a, psnip_uint8_t* b, size_t size) {
+  psnip_uint8_t tmp[64];
+  size_t n;
+
+  while (size > 0) {
+    n = size < sizeof(tmp) ? size : sizeof(tmp);
+    memcpy(tmp, a, n);
+    memcpy(a, b, n);
+    memcpy(b, tmp, n);
+    a += n;
+    b += n;
+    size -= n;
+  }
+}
+
+/* Fisher-Yates, from the end of the array.  The indices don't depend
+ * on the contents of the array, so they are generated a block at a
+ * time and the elements they point to are prefetched before any of
+ * them are swapped; for arrays which don't fit in cache this turns a
+ * chain of dependent cache misses into parallel ones.  Once the
+ * unshuffled part of the array is small enough to be cached the
+ * bookkeeping costs more than it saves, so we stop blocking.
+ *
+ * This is expanded once for each swap macro below so swapping 4- and
+ * 8-byte elements compiles down to plain loads and stores. */
+#define PSNIP_RANDOM__SHUFFLE_BLOCK 64
+#define PSNIP_RANDOM__SHUFFLE_PREFETCH_MIN (256 * 1024)
+
+#if defined(__GNUC__) || defined(__clang__)
+#  define PSNIP_RANDOM__PREFETCH(addr) __builtin_prefetch(addr, 1)
+#else
+#  define PSNIP_RANDOM__PREFETCH(addr) ((void) 0)
+#endif
+
+#define PSNIP_RANDOM__SHUFFLE(generator, count, size, swap) \
+  do { \
+    psnip_uint64_t j_[PSNIP_RANDOM__SHUFFLE_BLOCK]; \
+    size_t i_ = (count), k_; \
+    while (((psnip_uint64_t) i_) > 0xffffffffU) { \
+      j_[0] = psnip_random_generator_bounded_u64(generator, i_); \
+      swap(i_ - 1, (size_t) j_[0]); \
+      i_--; \
+    } \
+    /* i_ * (i_ - 1) fits in 64 bits from here on. */ \
+    for ( ; i_ >= PSNIP_RANDOM__SHUFFLE_BLOCK && (i_ * (size)) > PSNIP_RANDOM__SHUFFLE_PREFETCH_MIN ; i_ -= PSNIP_RANDOM__SHUFFLE_BLOCK) { \
+      for (k_ = 0 ; k_ < PSNIP_RANDOM__SHUFFLE_BLOCK ; k_ += 2) { \
+	psnip_random__bounded_pair(generator, i_ - k_, i_ - k_ - 1, &(j_[k_]), &(j_[k_ + 1])); \
+	PSNIP_RANDOM__PREFETCH(bytes + (((size_t) j_[k_]) * (size))); \
+	PSNIP_RANDOM__PREFETCH(bytes + (((size_t) j_[k_ + 1]) * (size))); \
+      } \
+      for (k_ = 0 ; k_ < PSNIP_RANDOM__SHUFFLE_BLOCK ; k_++) \
+	swap(i_ - k_ - 1, (size_t) j_[k_]); \
+    } \
+    for ( ; i_ > 2 ; i_ -= 2) { \
+      psnip_random__bounded_pair(generator, i_, i_ - 1, &(j_[0]), &(j_[1])); \
+      swap(i_ - 1, (size_t) j_[0]); \
+      swap(i_ - 2, (size_t) j_[1]); \
+    } \
+    if (i_ == 2) { \
+      j_[0] = psnip_random_generator_bounded_u32(generator, 2); \
+      swap(1, (size_t) j_[0]); \
+    } \
+  } while (0)
+
+#define PSNIP_RANDOM__SWAP_FIXED(T, a, b) \
+  do { \
+    T ta_, tb_; \
+    memcpy(&ta_, bytes + ((a) * sizeof(T)), sizeof(T)); \
+    memcpy(&tb_, bytes + ((b) * sizeof(T)), sizeof(T)); \
+    memcpy(bytes + ((a) * sizeof(T)), &tb_, sizeof(T)); \
+    memcpy(bytes + ((b) * sizeof(T)), &ta_, sizeof(T)); \
+  } while (0)
+#define PSNIP_RANDOM__SWAP_4(a, b) PSNIP_RANDOM__SWAP_FIXED(psnip_uint32_t, a, b)
+#define PSNIP_RANDOM__SWAP_8(a, b) PSNIP_RANDOM__SWAP_FIXED(psnip_uint64_t, a, b)
+#define PSNIP_RANDOM__SWAP_N(a, b) psnip_random__swap(bytes + ((a) * size), bytes + ((b) * size), size)
+
+void
+psnip_random_generator_shuffle (struct PSnipRandomGenerator* generator,
+				void* base,
+				size_t count,
+				size_t size) {
+  struct PSnipRandomGenerator g;
+  psnip_uint8_t* bytes = (psnip_uint8_t*) base;
+
+  assert(generator != NULL);
+  assert(base != NULL || count == 0);
+
+  g = *generator;
+  switch (size) {
+    case 4:
+      PSNIP_RANDOM__SHUFFLE(&g, count, 4, PSNIP_RANDOM__SWAP_4);
+      break;
+    case 8:
+      PSNIP_RANDOM__SHUFFLE(&g, count, 8, PSNIP_RANDOM__SWAP_8);
+      break;
+    default:
+      PSNIP_RANDOM__SHUFFLE(&g, count, size, PSNIP_RANDOM__SWAP_N);
+      break;
+  }
+  *generator = g;
+}
+
+/* Reservoir sampling with Li's "Algorithm L" (ACM TOMS, 1994): rather
+ * than drawing a random number for every element of the population,
+ * draw the (geometrically distributed) number of elements to skip
+ * before the next one which enters the reservoir.  That needs
+ * O(count * (1 + log(population / count))) random numbers instead of
+ * O(population).  log(w) is tracked instead of w.  log(1 - w) is
+ * computed with log1p(-w) while w is small, which is what large
+ * populations lead to, and with expm1 while w is close to 1, so it
+ * doesn't lose precision either way.  Once w is too small to matter
+ * the next skip would be past the end of the population. */
+size_t
+psnip_random_generator_sample (struct PSnipRandomGenerator* generator,
+			       size_t population,
+			       size_t count,
+			       size_t indices[PSNIP_RANDOM_ARRAY_PARAM(count)]) {
+  struct PSnipRandomGenerator g;
+  double log_w, log_1mw, skip;
+  size_t i;
+
+  assert(generator != NULL);
+
+  if (count > population)
+    count = population;
+  if (count == 0)
+    return 0;
+
+  for (i = 0 ; i < count ; i++)
+    indices[i] = i;
+
+  g = *generator;
+#define PSNIP_RANDOM__U53_OPEN() \
+  ((((double) (psnip_random_generator_next_u64(&g) >> 11)) + 0.5) * (1.0 / 9007199254740992.0))
+
+  log_w = log(PSNIP_RANDOM__U53_OPEN()) / (double) count;
+  i = count - 1;
+  for (;;) {
+    log_1mw = (log_w < -0.693147180559945309) ? log1p(-exp(log_w)) : log(-expm1(log_w));
+    skip = floor(log(PSNIP_RANDOM__U53_OPEN()) / log_1mw);
+    if (!(skip >= 0.0) || skip >= (double) (population - i - 1))
+      break;
+    i += ((size_t) skip) + 1;
+    indices[psnip_random_generator_bounded_u64(&g, count)] = i;
+    log_w += log(PSNIP_RANDOM__U53_OPEN()) / (double) count;
+  }
+
+#undef PSNIP_RANDOM__U53_OPEN
+  *generator = g;
+
+  return count;
+}
@@ -15,6 +15,28 @@
 #  define PSNIP_RANDOM_ARRAY_PARAM(expr)
 #endif
 
+#if !defined(PSNIP_RANDOM_STATIC_INLINE)
+#  if defined(__GNUC__)
+#    define PSNIP_RANDOM__COMPILER_ATTRIBUTES __attribute__((__unused__))
+#  else
+#    define PSNIP_RANDOM__COMPILER_ATTRIBUTES
+#  endif
+
+#  if defined(HEDLEY_INLINE)
+#    define PSNIP_RANDOM__INLINE HEDLEY_INLINE
+#  elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 199901L
+#    define PSNIP_RANDOM__INLINE inline
+#  elif defined(__GNUC_STDC_INLINE__)
+#    define PSNIP_RANDOM__INLINE __inline__
+#  elif defined(_MSC_VER) && _MSC_VER >= 1200
+#    define PSNIP_RANDOM__INLINE __inline
+#  else
+#    define PSNIP_RANDOM__INLINE
+#  endif
+
+#  define PSNIP_RANDOM__FUNCTION PSNIP_RANDOM__COMPILER_ATTRIBUTES static PSNIP_RANDOM__INLINE
+#endif
+
 #if defined(__cplusplus)
 extern "C" {
 #endif
@@ -23,6 +45,8 @@ enum PSnipRandomSource {
   PSNIP_RANDOM_SOURCE_SECURE,
   PSNIP_RANDOM_SOURCE_REPRODUCIBLE,
   PSNIP_RANDOM_SOURCE_FAST,
+  PSNIP_RANDOM_SOURCE_HARDWARE,
+  PSNIP_RANDOM_SOURCE_COUNTER,
 };
 
 int            psnip_random_bytes    (enum PSnipRandomSource source,
@@ -31,6 +55,186 @@ int            psnip_random_bytes    (enum PSnipRandomSource source,
 psnip_uint32_t psnip_random_get_seed (void);
 void           psnip_random_set_seed (psnip_uint32_t seed);
 
+/* Random access to the counter-based (Philox4x32-10) stream; byte
+ * `offset` of the stream for `key` can be computed directly. */
+void           psnip_random_counter_bytes (psnip_uint64_t key,
+					   psnip_uint64_t offset,
+					   size_t length,
+					   psnip_uint8_t data[PSNIP_RANDOM_ARRAY_PARAM(length)]);
+
+/* Generator objects
+ *
+ * A generator is a PCG instance (64-bit state) owned by the caller.
+ * Nothing is shared between generators, so there are no atomic
+ * operations and no locking; if you want one per thread just put one
+ * in each thread's context. */
+
+struct PSnipRandomGenerator {
+  psnip_uint64_t state;
+  psnip_uint64_t increment;
+};
+
+int            psnip_random_generator_init  (struct PSnipRandomGenerator* generator,
+					     enum PSnipRandomSource source);
+void           psnip_random_generator_seed  (struct PSnipRandomGenerator* generator,
+					     psnip_uint64_t seed);
+void           psnip_random_generator_seed_stream (struct PSnipRandomGenerator* generator,
+						   psnip_uint64_t seed,
+						   psnip_uint64_t stream);
+void           psnip_random_generator_advance (struct PSnipRandomGenerator* generator,
+					       psnip_uint64_t delta);
+
+void           psnip_random_generator_fill_bounded_u32 (struct PSnipRandomGenerator* generator,
+							psnip_uint32_t bound,
+							size_t count,
+							psnip_uint32_t values[PSNIP_RANDOM_ARRAY_PARAM(count)]);
+void           psnip_random_generator_fill_bounded_u64 (struct PSnipRandomGenerator* generator,
+							psnip_uint64_t bound,
+							size_t count,
+							psnip_uint64_t values[PSNIP_RANDOM_ARRAY_PARAM(count)]);
+void           psnip_random_generator_fill_float       (struct PSnipRandomGenerator* generator,
+							size_t count,
+							float values[PSNIP_RANDOM_ARRAY_PARAM(count)]);
+void           psnip_random_generator_fill_double      (struct PSnipRandomGenerator* generator,
+							size_t count,
+							double values[PSNIP_RANDOM_ARRAY_PARAM(count)]);
+
+double         psnip_random_generator_next_normal      (struct PSnipRandomGenerator* generator);
+double         psnip_random_generator_next_exponential (struct PSnipRandomGenerator* generator);
+void           psnip_random_generator_fill_normal      (struct PSnipRandomGenerator* generator,
+							size_t count,
+							double values[PSNIP_RANDOM_ARRAY_PARAM(count)]);
+void           psnip_random_generator_fill_exponential (struct PSnipRandomGenerator* generator,
+							size_t count,
+							double values[PSNIP_RANDOM_ARRAY_PARAM(count)]);
+
+void           psnip_random_generator_shuffle (struct PSnipRandomGenerator* generator,
+					       void* base,
+					       size_t count,
+					       size_t size);
+size_t         psnip_random_generator_sample  (struct PSnipRandomGenerator* generator,
+					       size_t population,
+					       size_t count,
+					       size_t indices[PSNIP_RANDOM_ARRAY_PARAM(count)]);
+void           psnip_random_generator_bytes (struct PSnipRandomGenerator* generator,
+					     size_t length,
+					     psnip_uint8_t data[PSNIP_RANDOM_ARRAY_PARAM(length)]);
+
+#define PSNIP_RANDOM__PCG64_MULTIPLIER (6364136223846793005ULL)
+#define PSNIP_RANDOM__PCG64_INCREMENT  (1442695040888963407ULL)
+
+PSNIP_RANDOM__FUNCTION psnip_uint64_t
+psnip_random__pcg64_next_state(psnip_uint64_t state, psnip_uint64_t increment) {
+  return state * PSNIP_RANDOM__PCG64_MULTIPLIER + increment;
+}
+
+/* RXS M XS; 64 bits of output from 64 bits of state. */
+PSNIP_RANDOM__FUNCTION psnip_uint64_t
+psnip_random__pcg64_from_state(psnip_uint64_t state) {
+  psnip_uint64_t res = ((state >> ((state >> 59) + 5)) ^ state) * (12605985483714917081ULL);
+  res ^= res >> 43;
+  return res;
+}
+
+/* XSH RR; 32 bits of output from 64 bits of state. */
+PSNIP_RANDOM__FUNCTION psnip_uint32_t
+psnip_random__pcg64_from_state32(psnip_uint64_t state) {
+  const psnip_uint32_t xorshifted = (psnip_uint32_t) (((state >> 18) ^ state) >> 27);
+  const unsigned int rot = (unsigned int) (state >> 59);
+  return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+}
+
+PSNIP_RANDOM__FUNCTION psnip_uint64_t
+psnip_random_generator_next_u64 (struct PSnipRandomGenerator* generator) {
+  const psnip_uint64_t state = generator->state;
+  generator->state = psnip_random__pcg64_next_state(state, generator->increment);
+  return psnip_random__pcg64_from_state(state);
+}
+
+PSNIP_RANDOM__FUNCTION psnip_uint32_t
+psnip_random_generator_next_u32 (struct PSnipRandomGenerator* generator) {
+  const psnip_uint64_t state = generator->state;
+  generator->state = psnip_random__pcg64_next_state(state, generator->increment);
+  return psnip_random__pcg64_from_state32(state);
+}
+
+/* Bounded integers
+ *
+ * These return a uniformly distributed value in [0, bound) using
+ * Lemire's multiply-shift method ("Fast Random Integer Generation in
+ * an Interval", ACM TOMACS, 2019): the random value is multiplied by
+ * the bound and the high half of the product is the result.  A few
+ * products have to be rejected to avoid bias, but the (slow) division
+ * needed to tell which ones is only performed when the low half of
+ * the product is less than the bound, which is rare unless the bound
+ * is huge.  A bound of 0 always yields 0. */
+
+PSNIP_RANDOM__FUNCTION psnip_uint32_t
+psnip_random_generator_bounded_u32 (struct PSnipRandomGenerator* generator, psnip_uint32_t bound) {
+  psnip_uint64_t m = ((psnip_uint64_t) psnip_random_generator_next_u32(generator)) * bound;
+  psnip_uint32_t l = (psnip_uint32_t) m;
+
+  if (l < bound) {
+    const psnip_uint32_t t = (0 - bound) % bound;
+    while (l < t) {
+      m = ((psnip_uint64_t) psnip_random_generator_next_u32(generator)) * bound;
+      l = (psnip_uint32_t) m;
+    }
+  }
+
+  return (psnip_uint32_t) (m >> 32);
+}
+
+/* Full 64x64 -> 128-bit multiplication; returns the low half and
+ * stores the high half in *hi. */
+PSNIP_RANDOM__FUNCTION psnip_uint64_t
+psnip_random__mul64 (psnip_uint64_t a, psnip_uint64_t b, psnip_uint64_t* hi) {
+#if defined(__SIZEOF_INT128__)
+  __extension__ typedef unsigned __int128 psnip_random__uint128;
+  const psnip_random__uint128 r = ((psnip_random__uint128) a) * b;
+  *hi = (psnip_uint64_t) (r >> 64);
+  return (psnip_uint64_t) r;
+#else
+  const psnip_uint64_t a_lo = a & 0xffffffffU, a_hi = a >> 32;
+  const psnip_uint64_t b_lo = b & 0xffffffffU, b_hi = b >> 32;
+  const psnip_uint64_t lo_lo = a_lo * b_lo;
+  const psnip_uint64_t hi_lo = a_hi * b_lo;
+  const psnip_uint64_t lo_hi = a_lo * b_hi;
+  const psnip_uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xffffffffU) + lo_hi;
+  *hi = (a_hi * b_hi) + (hi_lo >> 32) + (cross >> 32);
+  return (cross << 32) | (lo_lo & 0xffffffffU);
+#endif
+}
+
+PSNIP_RANDOM__FUNCTION psnip_uint64_t
+psnip_random_generator_bounded_u64 (struct PSnipRandomGenerator* generator, psnip_uint64_t bound) {
+  psnip_uint64_t hi;
+  psnip_uint64_t l = psnip_random__mul64(psnip_random_generator_next_u64(generator), bound, &hi);
+
+  if (l < bound) {
+    const psnip_uint64_t t = (0 - bound) % bound;
+    while (l < t)
+      l = psnip_random__mul64(psnip_random_generator_next_u64(generator), bound, &hi);
+  }
+
+  return hi;
+}
+
+/* Floating point
+ *
+ * Uniformly distributed values in [0, 1), using the top 53 (or 24)
+ * bits of a random value as the mantissa. */
+
+PSNIP_RANDOM__FUNCTION double
+psnip_random_generator_next_double (struct PSnipRandomGenerator* generator) {
+  return ((double) (psnip_random_generator_next_u64(generator) >> 11)) * (1.0 / 9007199254740992.0);
+}
+
+PSNIP_RANDOM__FUNCTION float
+psnip_random_generator_next_float (struct PSnipRandomGenerator* generator) {
+  return ((float) (psnip_random_generator_next_u32(generator) >> 8)) * (1.0f / 16777216.0f);
+}
+
 #if defined(__cplusplus)
 }
 #endif
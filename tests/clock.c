@@ -1,6 +1,7 @@
 #define _POSIX_C_SOURCE 199309L
 
 #include "../exact-int/exact-int.h"
+#include "../cpu/cpu.h"
 #include "../clock/clock.h"
 #include "munit/munit.h"
 
@@ -158,11 +159,58 @@ test_clock_monotonic(const MunitParameter params[], void* data) {
 #endif
 }
 
+static MunitResult
+test_clock_tsc(const MunitParameter params[], void* data) {
+#if defined(PSNIP_CLOCK_MONOTONIC_METHOD)
+  struct PsnipClockTimespec res1, res2, mono1, mono2;
+  psnip_uint32_t precision = psnip_clock_get_precision(PSNIP_CLOCK_TYPE_TSC);
+  int r;
+  int elapsed_ms, mono_elapsed_ms;
+
+#if defined(PSNIP_CLOCK_TSC_METHOD)
+  munit_logf(MUNIT_LOG_DEBUG, "TSC clock method: %d", PSNIP_CLOCK_TSC_METHOD);
+#endif
+
+  munit_assert_uint32(precision, !=, 0);
+
+  r = psnip_clock_get_time(PSNIP_CLOCK_TYPE_MONOTONIC, &mono1);
+  munit_assert_int(r, ==, 0);
+  r = psnip_clock_get_time(PSNIP_CLOCK_TYPE_TSC, &res1);
+  munit_assert_int(r, ==, 0);
+
+  sleep_seconds(1);
+
+  r = psnip_clock_get_time(PSNIP_CLOCK_TYPE_TSC, &res2);
+  munit_assert_int(r, ==, 0);
+  r = psnip_clock_get_time(PSNIP_CLOCK_TYPE_MONOTONIC, &mono2);
+  munit_assert_int(r, ==, 0);
+
+  elapsed_ms = ts_difference(&res1, &res2);
+  mono_elapsed_ms = ts_difference(&mono1, &mono2);
+
+  munit_assert_int(elapsed_ms, >,  900);
+  munit_assert_int(elapsed_ms, <, 1100);
+  munit_assert_int(elapsed_ms, <=, mono_elapsed_ms + 1);
+  munit_assert_int(elapsed_ms, >=, mono_elapsed_ms - 10);
+
+  (void) params;
+  (void) data;
+
+  return MUNIT_OK;
+#else
+  (void) params;
+  (void) data;
+
+  return MUNIT_SKIP;
+#endif
+}
+
 static MunitTest test_suite_tests[] = {
   { (char*) "/clock/wall/time",     test_clock_wall_time,     NULL, NULL, MUNIT_TEST_OPTION_SINGLE_ITERATION, NULL },
   { (char*) "/clock/wall/veracity", test_clock_wall_veracity, NULL, NULL, MUNIT_TEST_OPTION_SINGLE_ITERATION, NULL },
   { (char*) "/clock/cpu",           test_clock_cpu,           NULL, NULL, MUNIT_TEST_OPTION_SINGLE_ITERATION, NULL },
   { (char*) "/clock/monotonic",     test_clock_monotonic,     NULL, NULL, MUNIT_TEST_OPTION_SINGLE_ITERATION, NULL },
+  { (char*) "/clock/tsc",           test_clock_tsc,           NULL, NULL, MUNIT_TEST_OPTION_SINGLE_ITERATION, NULL },
   { NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
 };
 
@@ -2,6 +2,8 @@
 #include "../cpu/cpu.h"
 #include "munit/munit.h"
 
+#include <stdlib.h>
+
 static MunitResult
 test_cpu_info(const MunitParameter params[], void* data) {
   (void) params;
@@ -23,6 +25,25 @@ test_cpu_info(const MunitParameter params[], void* data) {
   munit_assert_int(__builtin_cpu_supports("avx2")    != 0, ==, psnip_cpu_feature_check(PSNIP_CPU_FEATURE_X86_AVX2));
 #if __GNUC__ >= 5
   munit_assert_int(__builtin_cpu_supports("avx512f") != 0, ==, psnip_cpu_feature_check(PSNIP_CPU_FEATURE_X86_AVX512F));
+  munit_assert_int(__builtin_cpu_supports("sse4a")   != 0, ==, psnip_cpu_feature_check(PSNIP_CPU_FEATURE_X86_SSE4A));
+  munit_assert_int(__builtin_cpu_supports("fma4")    != 0, ==, psnip_cpu_feature_check(PSNIP_CPU_FEATURE_X86_FMA4));
+  munit_assert_int(__builtin_cpu_supports("xop")     != 0, ==, psnip_cpu_feature_check(PSNIP_CPU_FEATURE_X86_XOP));
+#endif
+#if __GNUC__ >= 8
+  munit_assert_int(__builtin_cpu_supports("avx512vbmi2")  != 0, ==, psnip_cpu_feature_check(PSNIP_CPU_FEATURE_X86_AVX512VBMI2));
+  munit_assert_int(__builtin_cpu_supports("avx512vnni")   != 0, ==, psnip_cpu_feature_check(PSNIP_CPU_FEATURE_X86_AVX512VNNI));
+  munit_assert_int(__builtin_cpu_supports("avx512bitalg") != 0, ==, psnip_cpu_feature_check(PSNIP_CPU_FEATURE_X86_AVX512BITALG));
+  munit_assert_int(__builtin_cpu_supports("gfni")         != 0, ==, psnip_cpu_feature_check(PSNIP_CPU_FEATURE_X86_GFNI));
+  munit_assert_int(__builtin_cpu_supports("vaes")         != 0, ==, psnip_cpu_feature_check(PSNIP_CPU_FEATURE_X86_VAES));
+  munit_assert_int(__builtin_cpu_supports("vpclmulqdq")   != 0, ==, psnip_cpu_feature_check(PSNIP_CPU_FEATURE_X86_VPCLMULQDQ));
+#endif
+#if __GNUC__ >= 11
+  munit_assert_int(__builtin_cpu_supports("avx512bf16")   != 0, ==, psnip_cpu_feature_check(PSNIP_CPU_FEATURE_X86_AVX512BF16));
+  munit_assert_int(__builtin_cpu_supports("avxvnni")      != 0, ==, psnip_cpu_feature_check(PSNIP_CPU_FEATURE_X86_AVX_VNNI));
+#endif
+#if __GNUC__ >= 12
+  munit_assert_int(__builtin_cpu_supports("lzcnt")        != 0, ==, psnip_cpu_feature_check(PSNIP_CPU_FEATURE_X86_LZCNT));
+  munit_assert_int(__builtin_cpu_supports("avx512fp16")   != 0, ==, psnip_cpu_feature_check(PSNIP_CPU_FEATURE_X86_AVX512FP16));
 #endif
 
   return MUNIT_OK;
@@ -32,19 +53,347 @@ test_cpu_info(const MunitParameter params[], void* data) {
   return MUNIT_SKIP;
 }
 
+/* Anything the compiler was allowed to use must be supported, or we
+ * wouldn't be running. */
+static MunitResult
+test_cpu_compiled(const MunitParameter params[], void* data) {
+  enum PSnipCPUFeature feature;
+  int compiled = 0;
+
+  (void) params;
+  (void) data;
+
+#if defined(PSNIP_CPU_ARCH_X86) || defined(PSNIP_CPU_ARCH_X86_64)
+  for (feature = PSNIP_CPU_FEATURE_X86 ; feature <= (enum PSnipCPUFeature) (PSNIP_CPU_FEATURE_X86 | 0x00ffffff) ; feature = (enum PSnipCPUFeature) (feature + 1)) {
+#elif defined(PSNIP_CPU_ARCH_ARM64)
+  for (feature = PSNIP_CPU_FEATURE_ARM64 ; feature <= (enum PSnipCPUFeature) (PSNIP_CPU_FEATURE_ARM64 | 0x0000ffff) ; feature = (enum PSnipCPUFeature) (feature + 1)) {
+#elif defined(PSNIP_CPU_ARCH_ARM)
+  for (feature = PSNIP_CPU_FEATURE_ARM ; feature <= (enum PSnipCPUFeature) (PSNIP_CPU_FEATURE_ARM | 0x0000ffff) ; feature = (enum PSnipCPUFeature) (feature + 1)) {
+#else
+  for (feature = PSNIP_CPU_FEATURE_NONE ; 0 ; ) {
+#endif
+    if (psnip_cpu__feature_compiled(feature)) {
+      munit_assert_int(psnip_cpu__feature_check_init(feature), ==, 1);
+      munit_assert_int(psnip_cpu_feature_check(feature), ==, 1);
+      compiled++;
+    }
+  }
+
+  return (compiled > 0) ? MUNIT_OK : MUNIT_SKIP;
+}
+
+static MunitResult
+test_cpu_sve(const MunitParameter params[], void* data) {
+  const int vl = psnip_cpu_sve_vector_length();
+
+  (void) params;
+  (void) data;
+
+  if (!psnip_cpu_feature_check(PSNIP_CPU_FEATURE_ARM64_SVE)) {
+    munit_assert_int(vl, ==, 0);
+    return MUNIT_SKIP;
+  }
+
+  /* 128 to 2048 bits, in multiples of 128. */
+  munit_assert_int(vl, >=, 16);
+  munit_assert_int(vl, <=, 256);
+  munit_assert_int(vl % 16, ==, 0);
+
+  return MUNIT_OK;
+}
+
+static MunitResult
+test_cpu_tsc(const MunitParameter params[], void* data) {
+  const double freq = psnip_cpu_tsc_frequency();
+
+  (void) params;
+  (void) data;
+
+#if defined(PSNIP_CPU_ARCH_X86) || defined(PSNIP_CPU_ARCH_X86_64)
+  if (!psnip_cpu_feature_check(PSNIP_CPU_FEATURE_X86_INVARIANT_TSC)) {
+    munit_assert_double(freq, ==, 0.0);
+    return MUNIT_SKIP;
+  }
+#endif
+  if (freq == 0.0)
+    return MUNIT_SKIP;
+
+  munit_logf(MUNIT_LOG_DEBUG, "counter frequency: %.0f Hz", freq);
+  munit_assert_double(freq, >=, 1e6);
+  munit_assert_double(freq, <=, 1e11);
+  munit_assert_double(freq, ==, psnip_cpu_tsc_frequency());
+
+  return MUNIT_OK;
+}
+
 static MunitResult
 test_cpu_count(const MunitParameter params[], void* data) {
   (void) params;
   (void) data;
 
   munit_assert_int(psnip_cpu_count(), >, 0);
+  munit_assert_int(psnip_cpu_count_available(), >, 0);
+  munit_assert_int(psnip_cpu_count_available(), <=, psnip_cpu_count());
 
   return MUNIT_OK;
 }
 
+static MunitResult
+test_cpu_cache(const MunitParameter params[], void* data) {
+  const struct PSnipCPUCache* cache;
+  const struct PSnipCPUCache* prev = NULL;
+  int i, count;
+
+  (void) params;
+  (void) data;
+
+  count = psnip_cpu_cache_count();
+  munit_assert_int(count, >=, 0);
+  if (count == 0)
+    return MUNIT_SKIP;
+
+  for (i = 0 ; i < count ; i++) {
+    cache = psnip_cpu_cache_get(i);
+    munit_assert_not_null(cache);
+    munit_logf(MUNIT_LOG_DEBUG, "L%d type %d: %lu bytes, %d byte lines, %d ways, shared by %d",
+	       cache->level, (int) cache->type, (unsigned long) cache->size,
+	       cache->line_size, cache->associativity, cache->shared_by);
+
+    munit_assert_int(cache->level, >=, 1);
+    munit_assert_size(cache->size, >, 0);
+    munit_assert_int(cache->line_size, >=, 0);
+    if (cache->line_size > 0)
+      munit_assert_int(cache->line_size & (cache->line_size - 1), ==, 0);
+    if (prev != NULL)
+      munit_assert_int(prev->level, <=, cache->level);
+    prev = cache;
+  }
+  munit_assert_null(psnip_cpu_cache_get(count));
+
+  cache = psnip_cpu_cache_find(1, PSNIP_CPU_CACHE_TYPE_DATA);
+  munit_assert_not_null(cache);
+  munit_assert_int(cache->level, ==, 1);
+  munit_assert_int(cache->type, !=, PSNIP_CPU_CACHE_TYPE_INSTRUCTION);
+
+  return MUNIT_OK;
+}
+
+static MunitResult
+test_cpu_topology(const MunitParameter params[], void* data) {
+  const struct PSnipCPUTopology* topo;
+  const struct PSnipCPUTopology* prev = NULL;
+  int i, j, count, nodes, node, fastest = 0;
+
+  (void) params;
+  (void) data;
+
+  count = psnip_cpu_topology_count();
+  munit_assert_int(count, >, 0);
+
+  nodes = psnip_cpu_node_count();
+  munit_assert_int(nodes, >, 0);
+
+  for (i = 0 ; i < count ; i++) {
+    topo = psnip_cpu_topology_get(i);
+    munit_assert_not_null(topo);
+    munit_logf(MUNIT_LOG_DEBUG, "cpu %d: package %d, core %d, thread %d, node %d, type %d, capacity %d",
+	       topo->cpu, topo->package, topo->core, topo->thread, topo->node,
+	       (int) topo->core_type, topo->capacity);
+
+    munit_assert_int(topo->package, >=, 0);
+    munit_assert_int(topo->thread, >=, 0);
+    munit_assert_int(topo->core_type, >=, PSNIP_CPU_CORE_TYPE_UNKNOWN);
+    munit_assert_int(topo->core_type, <=, PSNIP_CPU_CORE_TYPE_EFFICIENCY);
+    munit_assert_int(topo->capacity, >=, 0);
+    munit_assert_int(topo->capacity, <=, 1024);
+    if (topo->capacity == 1024)
+      fastest = 1;
+    munit_assert_ptr_equal(topo, psnip_cpu_topology_find(topo->cpu));
+    munit_assert_int(psnip_cpu_node_distance(topo->node, topo->node), >, 0);
+    if (prev != NULL)
+      munit_assert_int(prev->cpu, <, topo->cpu);
+    prev = topo;
+  }
+  munit_assert_null(psnip_cpu_topology_get(count));
+  munit_assert_null(psnip_cpu_topology_find(-1));
+#if defined(PSNIP_CPU_ARCH_X86) || defined(PSNIP_CPU_ARCH_X86_64)
+  if (!psnip_cpu_feature_check(PSNIP_CPU_FEATURE_X86_HYBRID))
+    munit_assert_int(fastest, ==, 1);
+#else
+  (void) fastest;
+#endif
+
+  for (i = 0 ; i < nodes ; i++) {
+    node = psnip_cpu_node_id(i);
+    for (j = 0 ; j < nodes ; j++)
+      munit_assert_int(psnip_cpu_node_distance(node, node), <=, psnip_cpu_node_distance(node, psnip_cpu_node_id(j)));
+  }
+  munit_assert_int(psnip_cpu_node_id(nodes), ==, -1);
+
+  return MUNIT_OK;
+}
+
+static MunitResult
+test_cpu_affinity(const MunitParameter params[], void* data) {
+  int* allowed;
+  int i, n, current;
+
+  (void) params;
+  (void) data;
+
+  n = psnip_cpu_allowed(NULL, 0);
+  if (n < 0)
+    return MUNIT_SKIP;
+  munit_assert_int(n, >, 0);
+
+  allowed = (int*) malloc(sizeof(int) * (size_t) n);
+  munit_assert_not_null(allowed);
+  munit_assert_int(psnip_cpu_allowed(allowed, n), ==, n);
+
+  current = psnip_cpu_current();
+  if (current >= 0) {
+    for (i = 0 ; i < n && allowed[i] != current ; i++) { }
+    munit_assert_int(i, <, n);
+  }
+
+  munit_assert_int(psnip_cpu_pin(-1), ==, -1);
+  if (psnip_cpu_pin(allowed[n - 1]) == 0) {
+    munit_assert_int(psnip_cpu_allowed(NULL, 0), ==, 1);
+    if (current >= 0)
+      munit_assert_int(psnip_cpu_current(), ==, allowed[n - 1]);
+#if defined(PSNIP_ENABLE_PTHREADS)
+    munit_assert_int(psnip_cpu_thread_pin_set(pthread_self(), allowed, n), ==, 0);
+#else
+    munit_assert_int(psnip_cpu_pin_set(allowed, n), ==, 0);
+#endif
+    munit_assert_int(psnip_cpu_allowed(NULL, 0), ==, n);
+  }
+
+  free(allowed);
+
+  return MUNIT_OK;
+}
+
+static int test_cpu_dispatch_generic    (int x) { return x + 1; }
+static int test_cpu_dispatch_sse2       (int x) { return x + 2; }
+static int test_cpu_dispatch_impossible (int x) { return x + 3; }
+
+static int test_cpu_dispatch_void_value = 0;
+static void test_cpu_dispatch_void_generic (int x) { test_cpu_dispatch_void_value = x + 1; }
+
+/* No CPU is both x86 and ARM. */
+static enum PSnipCPUFeature test_cpu_dispatch_impossible_features[] = {
+  PSNIP_CPU_FEATURE_X86_SSE2, PSNIP_CPU_FEATURE_ARM_NEON, PSNIP_CPU_FEATURE_NONE };
+static enum PSnipCPUFeature test_cpu_dispatch_sse2_features[] = {
+  PSNIP_CPU_FEATURE_X86_SSE2, PSNIP_CPU_FEATURE_NONE };
+
+static const struct PSnipCPUDispatch test_cpu_dispatch_table[] = {
+  { (PSnipCPUFunction) test_cpu_dispatch_impossible, test_cpu_dispatch_impossible_features },
+  { (PSnipCPUFunction) test_cpu_dispatch_sse2,       test_cpu_dispatch_sse2_features },
+  { (PSnipCPUFunction) test_cpu_dispatch_generic,    NULL },
+  { NULL, NULL }
+};
+
+static const struct PSnipCPUDispatch test_cpu_dispatch_void_table[] = {
+  { (PSnipCPUFunction) test_cpu_dispatch_void_generic, NULL },
+  { NULL, NULL }
+};
+
+int  test_cpu_dispatched      (int x);
+void test_cpu_dispatched_void (int x);
+
+PSNIP_CPU_DISPATCH(int, test_cpu_dispatched, (int x), (x), test_cpu_dispatch_table)
+PSNIP_CPU_DISPATCH_VOID(test_cpu_dispatched_void, (int x), (x), test_cpu_dispatch_void_table)
+
+static MunitResult
+test_cpu_dispatch(const MunitParameter params[], void* data) {
+  const int expected = psnip_cpu_feature_check(PSNIP_CPU_FEATURE_X86_SSE2) ? 2 : 1;
+
+  (void) params;
+  (void) data;
+
+  munit_assert(psnip_cpu_dispatch_select(test_cpu_dispatch_table) ==
+	       (expected == 2 ? (PSnipCPUFunction) test_cpu_dispatch_sse2 : (PSnipCPUFunction) test_cpu_dispatch_generic));
+  munit_assert(psnip_cpu_dispatch_select(test_cpu_dispatch_table + 3) == NULL);
+  munit_assert(psnip_cpu__dispatch_resolve(test_cpu_dispatch_table, "test") ==
+	       psnip_cpu_dispatch_select(test_cpu_dispatch_table));
+
+  /* The first call resolves the function, the second is direct. */
+  munit_assert_int(test_cpu_dispatched(40), ==, 40 + expected);
+  munit_assert_int(test_cpu_dispatched(41), ==, 41 + expected);
+
+  test_cpu_dispatched_void(7);
+  munit_assert_int(test_cpu_dispatch_void_value, ==, 8);
+
+  return MUNIT_OK;
+}
+
+/* The ifunc resolvers' CPUID-only check has to agree with the normal
+ * one (except for AMX, which it never reports). */
+static MunitResult
+test_cpu_dispatch_early(const MunitParameter params[], void* data) {
+#if defined(PSNIP_CPU_ARCH_X86) || defined(PSNIP_CPU_ARCH_X86_64)
+  enum PSnipCPUFeature features[2] = { PSNIP_CPU_FEATURE_NONE, PSNIP_CPU_FEATURE_NONE };
+  struct PSnipCPUDispatch table[3] = {
+    { (PSnipCPUFunction) test_cpu_dispatch_sse2,    NULL },
+    { (PSnipCPUFunction) test_cpu_dispatch_generic, NULL },
+    { NULL, NULL }
+  };
+  unsigned int slot, reg, bit;
+  int expected;
+
+  (void) params;
+  (void) data;
+
+  table[0].features = features;
+  for (slot = 0 ; slot < PSNIP_CPU__X86_INFO_SLOTS ; slot++) {
+    for (reg = 0 ; reg < 4 ; reg++) {
+      /* Leaf 1 EBX holds the APIC ID, which depends on where we run. */
+      if (slot == 1 && reg == 1)
+	continue;
+      for (bit = 0 ; bit < 32 ; bit++) {
+	features[0] = (enum PSnipCPUFeature) (PSNIP_CPU_FEATURE_X86 | (slot << 16) | (reg << 8) | bit);
+	switch ((unsigned int) features[0]) {
+	  case PSNIP_CPU_FEATURE_X86_AMX_BF16:
+	  case PSNIP_CPU_FEATURE_X86_AMX_TILE:
+	  case PSNIP_CPU_FEATURE_X86_AMX_INT8:
+	  case PSNIP_CPU_FEATURE_X86_AMX_FP16:
+	  case PSNIP_CPU_FEATURE_X86_AMX_COMPLEX:
+	    expected = psnip_cpu__feature_compiled(features[0]);
+	    break;
+	  default:
+	    expected = psnip_cpu_feature_check(features[0]);
+	    break;
+	}
+	munit_assert_int(psnip_cpu__dispatch_select_early(table) == table[0].function, ==, expected);
+      }
+    }
+  }
+
+  munit_assert(psnip_cpu__dispatch_select_early(test_cpu_dispatch_table) ==
+	       psnip_cpu_dispatch_select(test_cpu_dispatch_table));
+  munit_assert(psnip_cpu__dispatch_select_early(test_cpu_dispatch_table + 3) == NULL);
+
+  return MUNIT_OK;
+#else
+  (void) params;
+  (void) data;
+
+  return MUNIT_SKIP;
+#endif
+}
+
 static MunitTest test_suite_tests[] = {
   { (char*) "/cpu/info",  test_cpu_info,  NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+  { (char*) "/cpu/compiled", test_cpu_compiled, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+  { (char*) "/cpu/sve", test_cpu_sve, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+  { (char*) "/cpu/tsc", test_cpu_tsc, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
   { (char*) "/cpu/count", test_cpu_count, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+  { (char*) "/cpu/cache", test_cpu_cache, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+  { (char*) "/cpu/topology", test_cpu_topology, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+  { (char*) "/cpu/affinity", test_cpu_affinity, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+  { (char*) "/cpu/dispatch", test_cpu_dispatch, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+  { (char*) "/cpu/dispatch/early", test_cpu_dispatch_early, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
   { NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
 };
 
@@ -0,0 +1,298 @@
+/* Benchmarks for the random module.
+ *
+ * This isn't part of the test suite; build the random-benchmark
+ * target and run it by hand.  Each case is run repeatedly for about
+ * BENCHMARK_SECONDS and the throughput and average time per call are
+ * reported.
+ *
+ * Every source is measured with request sizes from 4 B to 16 MiB and,
+ * when built with PSNIP_ENABLE_PTHREADS, with 1 up to
+ * psnip_cpu_count() threads calling it at the same time (so
+ * contention on shared state shows up as throughput which doesn't
+ * scale).  Throughput is the total over all threads; the time per call
+ * is the average seen by each thread.
+ *
+ * The shuffle and sampling benchmarks use a single pass over an array
+ * of BENCHMARK_SHUFFLE_ELEMENTS elements by default; pass a different
+ * number of elements as the first argument to change it. */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include "../exact-int/exact-int.h"
+#include "../clock/clock.h"
+#include "../cpu/cpu.h"
+#include "../random/random.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#if defined(PSNIP_ENABLE_PTHREADS)
+#  include <pthread.h>
+#endif
+
+#define BENCHMARK_SECONDS 0.25
+#define BENCHMARK_MIN_SIZE 4
+#define BENCHMARK_MAX_SIZE (16 * 1024 * 1024)
+#define BENCHMARK_SHUFFLE_ELEMENTS 100000000
+
+static double
+benchmark_now (void) {
+  struct PsnipClockTimespec ts = { 0, 0 };
+
+  psnip_clock_get_time(PSNIP_CLOCK_TYPE_MONOTONIC, &ts);
+
+  return ((double) ts.seconds) + (((double) ts.nanoseconds) / 1000000000.0);
+}
+
+struct BenchmarkThread {
+  enum PSnipRandomSource source;
+  size_t size;
+  psnip_uint8_t* buf;
+  unsigned long calls;
+  double elapsed;
+};
+
+static void*
+benchmark_thread_run (void* data) {
+  struct BenchmarkThread* thread = (struct BenchmarkThread*) data;
+  /* Reading the clock can cost more than a small request, so only
+   * check it every 64 KiB or so. */
+  const unsigned long batch = (thread->size >= 65536) ? 1 : (unsigned long) (65536 / thread->size);
+  unsigned long i;
+  double start;
+
+  thread->calls = 0;
+  start = benchmark_now();
+  do {
+    for (i = 0 ; i < batch ; i++)
+      psnip_random_bytes(thread->source, thread->size, thread->buf);
+    thread->calls += batch;
+  } while ((thread->elapsed = benchmark_now() - start) < BENCHMARK_SECONDS);
+
+  return NULL;
+}
+
+/* Returns 0 on success, or the error from psnip_random_bytes if the
+ * source isn't available. */
+static int
+benchmark_source (const char* name, enum PSnipRandomSource source, size_t size, int threads) {
+  struct BenchmarkThread* state;
+  unsigned long calls = 0;
+  double elapsed = 0.0, thread_time = 0.0;
+  int i, r = 0;
+#if defined(PSNIP_ENABLE_PTHREADS)
+  pthread_t* handles;
+#endif
+
+  state = (struct BenchmarkThread*) calloc((size_t) threads, sizeof(struct BenchmarkThread));
+  if (state == NULL)
+    return -1;
+
+  for (i = 0 ; i < threads ; i++) {
+    state[i].source = source;
+    state[i].size = size;
+    state[i].buf = (psnip_uint8_t*) malloc(size);
+    if (state[i].buf == NULL) {
+      printf("%-14s %3d %10lu B   not enough memory\n", name, threads, (unsigned long) size);
+      goto out;
+    }
+  }
+
+  r = psnip_random_bytes(source, size, state[0].buf);
+  if (r != 0) {
+    printf("%-14s %3d %10lu B   unavailable (%d)\n", name, threads, (unsigned long) size, r);
+    goto out;
+  }
+
+#if defined(PSNIP_ENABLE_PTHREADS)
+  if (threads > 1) {
+    handles = (pthread_t*) calloc((size_t) threads, sizeof(pthread_t));
+    if (handles == NULL)
+      goto out;
+    for (i = 0 ; i < threads ; i++)
+      pthread_create(&(handles[i]), NULL, benchmark_thread_run, &(state[i]));
+    for (i = 0 ; i < threads ; i++)
+      pthread_join(handles[i], NULL);
+    free(handles);
+  } else
+#endif
+    benchmark_thread_run(&(state[0]));
+
+  for (i = 0 ; i < threads ; i++) {
+    calls += state[i].calls;
+    thread_time += state[i].elapsed;
+    if (state[i].elapsed > elapsed)
+      elapsed = state[i].elapsed;
+  }
+
+  printf("%-14s %3d %10lu B %12.1f ns/call %10.1f MB/s\n",
+	 name, threads, (unsigned long) size,
+	 (thread_time * 1000000000.0) / ((double) calls),
+	 (((double) size) * ((double) calls)) / elapsed / 1000000.0);
+
+ out:
+  for (i = 0 ; i < threads ; i++)
+    free(state[i].buf);
+  free(state);
+
+  return r;
+}
+
+/* Box-Muller, for comparison with the ziggurat. */
+static void
+benchmark_box_muller_fill (struct PSnipRandomGenerator* generator, size_t count, double* values) {
+  const double two_pi = 6.283185307179586476925286766559;
+  double r, theta;
+  size_t i;
+
+  for (i = 0 ; i + 1 < count ; i += 2) {
+    r = sqrt(-2.0 * log(1.0 - psnip_random_generator_next_double(generator)));
+    theta = two_pi * psnip_random_generator_next_double(generator);
+    values[i] = r * cos(theta);
+    values[i + 1] = r * sin(theta);
+  }
+  if (i < count) {
+    r = sqrt(-2.0 * log(1.0 - psnip_random_generator_next_double(generator)));
+    values[i] = r * cos(two_pi * psnip_random_generator_next_double(generator));
+  }
+}
+
+static void
+benchmark_normal (const char* name,
+		  void (* fill)(struct PSnipRandomGenerator* generator, size_t count, double* values),
+		  size_t count) {
+  struct PSnipRandomGenerator generator;
+  double* buf;
+  unsigned long calls = 0;
+  double start, elapsed;
+
+  buf = (double*) malloc(count * sizeof(double));
+  if (buf == NULL)
+    return;
+
+  psnip_random_generator_seed(&generator, 1729);
+
+  start = benchmark_now();
+  do {
+    fill(&generator, count, buf);
+    calls++;
+  } while ((elapsed = benchmark_now() - start) < BENCHMARK_SECONDS);
+
+  printf("%-24s %10lu   %12.2f ns/sample %8.1f M samples/s\n",
+	 name, (unsigned long) count,
+	 (elapsed * 1000000000.0) / (((double) calls) * ((double) count)),
+	 (((double) calls) * ((double) count)) / elapsed / 1000000.0);
+
+  free(buf);
+}
+
+/* Fisher-Yates with one bounded integer per element, for comparison
+ * with the batched psnip_random_generator_shuffle. */
+static void
+benchmark_shuffle_unbatched (struct PSnipRandomGenerator* generator, psnip_uint32_t* values, size_t count) {
+  psnip_uint32_t j, tmp;
+  size_t i;
+
+  for (i = count ; i > 1 ; i--) {
+    j = psnip_random_generator_bounded_u32(generator, (psnip_uint32_t) i);
+    tmp = values[i - 1];
+    values[i - 1] = values[j];
+    values[j] = tmp;
+  }
+}
+
+static void
+benchmark_shuffle (size_t count) {
+  struct PSnipRandomGenerator generator;
+  psnip_uint32_t* values;
+  size_t* indices;
+  size_t i, sample = count / 100;
+  double start, elapsed;
+
+  values = (psnip_uint32_t*) malloc(count * sizeof(psnip_uint32_t));
+  indices = (size_t*) malloc((sample > 0 ? sample : 1) * sizeof(size_t));
+  if (values == NULL || indices == NULL) {
+    printf("%-24s %10lu   not enough memory\n", "shuffle", (unsigned long) count);
+    free(values);
+    free(indices);
+    return;
+  }
+  for (i = 0 ; i < count ; i++)
+    values[i] = (psnip_uint32_t) i;
+
+  psnip_random_generator_seed(&generator, 1729);
+
+  start = benchmark_now();
+  psnip_random_generator_shuffle(&generator, values, count, sizeof(psnip_uint32_t));
+  elapsed = benchmark_now() - start;
+  printf("%-24s %10lu   %12.2f ns/element\n", "shuffle (batched)", (unsigned long) count,
+	 (elapsed * 1000000000.0) / (double) count);
+
+  start = benchmark_now();
+  benchmark_shuffle_unbatched(&generator, values, count);
+  elapsed = benchmark_now() - start;
+  printf("%-24s %10lu   %12.2f ns/element\n", "shuffle (unbatched)", (unsigned long) count,
+	 (elapsed * 1000000000.0) / (double) count);
+
+  start = benchmark_now();
+  psnip_random_generator_sample(&generator, count, sample, indices);
+  elapsed = benchmark_now() - start;
+  printf("%-24s %10lu   %12.2f ms for %lu\n", "sample", (unsigned long) count,
+	 elapsed * 1000.0, (unsigned long) sample);
+
+  free(values);
+  free(indices);
+}
+
+int
+main (int argc, char* argv[]) {
+  static const struct {
+    const char* name;
+    enum PSnipRandomSource source;
+  } sources[] = {
+    { "secure",       PSNIP_RANDOM_SOURCE_SECURE },
+    { "reproducible", PSNIP_RANDOM_SOURCE_REPRODUCIBLE },
+    { "fast",         PSNIP_RANDOM_SOURCE_FAST },
+    { "hardware",     PSNIP_RANDOM_SOURCE_HARDWARE },
+    { "counter",      PSNIP_RANDOM_SOURCE_COUNTER }
+  };
+  size_t shuffle_elements = BENCHMARK_SHUFFLE_ELEMENTS;
+  size_t i, size;
+  int threads, max_threads = 1, available;
+
+  if (argc > 1)
+    shuffle_elements = (size_t) strtoul(argv[1], NULL, 10);
+
+#if defined(PSNIP_ENABLE_PTHREADS)
+  max_threads = psnip_cpu_count();
+  if (max_threads < 1)
+    max_threads = 1;
+#endif
+
+  printf("%-14s %3s %12s %20s %15s\n", "source", "thr", "size", "latency", "throughput");
+  for (i = 0 ; i < sizeof(sources) / sizeof(sources[0]) ; i++) {
+    /* 1, 2, 4, ... threads, and finally one per CPU. */
+    for (threads = 1 ; ; threads *= 2) {
+      if (threads > max_threads)
+	threads = max_threads;
+
+      available = 1;
+      for (size = BENCHMARK_MIN_SIZE ; available && size <= BENCHMARK_MAX_SIZE ; size *= 4)
+	available = (benchmark_source(sources[i].name, sources[i].source, size, threads) == 0);
+
+      if (!available || threads == max_threads)
+	break;
+    }
+  }
+
+  /* Normal variates: ziggurat vs. Box-Muller. */
+  benchmark_normal("normal (ziggurat)", psnip_random_generator_fill_normal, 4096);
+  benchmark_normal("normal (box-muller)", benchmark_box_muller_fill, 4096);
+  benchmark_normal("exponential (ziggurat)", psnip_random_generator_fill_exponential, 4096);
+
+  /* Shuffling and sampling a large array of indices. */
+  benchmark_shuffle(shuffle_elements);
+
+  return EXIT_SUCCESS;
+}
@@ -1,7 +1,18 @@
+#if defined(PSNIP_ENABLE_PTHREADS)
+#  include <pthread.h>
+#endif
+#if !defined(_WIN32)
+#  include <sys/types.h>
+#  include <sys/wait.h>
+#  include <unistd.h>
+#endif
 #include "../exact-int/exact-int.h"
 #include "../random/random.h"
 #include "munit/munit.h"
 
+#include <stdlib.h>
+#include <string.h>
+
 static MunitResult
 test_random_secure(const MunitParameter params[], void* data) {
   psnip_uint8_t buf[4096] = { 0, };
@@ -24,6 +35,62 @@ test_random_secure(const MunitParameter params[], void* data) {
   return MUNIT_OK;
 }
 
+#if !defined(_WIN32)
+/* The parent and a forked child must not get the same bytes from a
+ * source, even if it buffers data or state in memory. */
+static void
+assert_fork_unique(enum PSnipRandomSource source) {
+  psnip_uint8_t parent[16], child[16];
+  int fds[2], status;
+  pid_t pid;
+
+  /* Make sure any lazily-initialized state exists before forking. */
+  munit_assert_int(psnip_random_bytes(source, sizeof(parent), parent), ==, 0);
+
+  munit_assert_int(pipe(fds), ==, 0);
+  pid = fork();
+  munit_assert_int(pid, >=, 0);
+  if (pid == 0) {
+    if (psnip_random_bytes(source, sizeof(child), child) != 0 ||
+	write(fds[1], child, sizeof(child)) != (ssize_t) sizeof(child))
+      _exit(1);
+    _exit(0);
+  }
+
+  munit_assert_int(psnip_random_bytes(source, sizeof(parent), parent), ==, 0);
+  munit_assert_int(read(fds[0], child, sizeof(child)), ==, sizeof(child));
+  munit_assert_int(waitpid(pid, &status, 0), ==, pid);
+  close(fds[0]);
+  close(fds[1]);
+
+  munit_assert_memory_not_equal(sizeof(parent), parent, child);
+}
+#endif
+
+static MunitResult
+test_random_secure_small(const MunitParameter params[], void* data) {
+  psnip_uint8_t tokens[64][16];
+  size_t i, j;
+
+  (void) params;
+  (void) data;
+
+  /* Small requests may be served from a buffer; make sure we never
+   * hand out the same bytes twice. */
+  for (i = 0 ; i < sizeof(tokens) / sizeof(tokens[0]) ; i++)
+    munit_assert_int(psnip_random_bytes(PSNIP_RANDOM_SOURCE_SECURE, sizeof(tokens[i]), tokens[i]), ==, 0);
+
+  for (i = 0 ; i < sizeof(tokens) / sizeof(tokens[0]) ; i++)
+    for (j = i + 1 ; j < sizeof(tokens) / sizeof(tokens[0]) ; j++)
+      munit_assert_memory_not_equal(sizeof(tokens[i]), tokens[i], tokens[j]);
+
+#if !defined(_WIN32)
+  assert_fork_unique(PSNIP_RANDOM_SOURCE_SECURE);
+#endif
+
+  return MUNIT_OK;
+}
+
 static MunitResult
 test_random_reproducible(const MunitParameter params[], void* data) {
   const psnip_uint32_t test_data[] = {
@@ -74,13 +141,471 @@ test_random_fast(const MunitParameter params[], void* data) {
 
   munit_assert_size(p, <, sizeof(buf));
 
+#if !defined(_WIN32)
+  assert_fork_unique(PSNIP_RANDOM_SOURCE_FAST);
+#endif
+
+  return MUNIT_OK;
+}
+
+static MunitResult
+test_random_hardware(const MunitParameter params[], void* data) {
+  psnip_uint8_t buf[4096 + 3] = { 0, };
+  int r;
+  size_t p;
+
+  (void) params;
+  (void) data;
+
+  r = psnip_random_bytes(PSNIP_RANDOM_SOURCE_HARDWARE, sizeof(buf), buf);
+  if (r == -1)
+    return MUNIT_SKIP;
+  munit_assert_int(r, ==, 0);
+
+  for (p = 0 ; p < sizeof(buf) ; p++)
+    if (buf[p] != 0)
+      break;
+
+  munit_assert_size(p, <, sizeof(buf));
+
+  return MUNIT_OK;
+}
+
+static MunitResult
+test_random_generator(const MunitParameter params[], void* data) {
+  const psnip_uint64_t test_data64[] = {
+    0x0d46d560bf55848fULL, 0xafd6eb4130f32080ULL,
+    0x7ac8956181568d00ULL, 0xf88536a699825cb7ULL,
+    0x0f9c7fcdc07865f8ULL, 0xe894ba2ecf00e27bULL,
+    0xfad692e69ff28c7bULL, 0xa4ef8494775ec248ULL
+  };
+  const psnip_uint32_t test_data32[] = {
+    0xcb840e2cU, 0x469a89c7U, 0x254a2778U, 0x5cdcfda0U,
+    0x32bc0770U, 0xe56c9327U, 0x72209cecU, 0x4ae0f9cbU
+  };
+  psnip_uint64_t buf[sizeof(test_data64) / sizeof(test_data64[0])] = { 0, };
+  struct PSnipRandomGenerator generator;
+  size_t i;
+
+  (void) params;
+  (void) data;
+
+  psnip_random_generator_seed(&generator, 1729);
+  for (i = 0 ; i < sizeof(test_data64) / sizeof(test_data64[0]) ; i++)
+    munit_assert_uint64(psnip_random_generator_next_u64(&generator), ==, test_data64[i]);
+
+  psnip_random_generator_seed(&generator, 1729);
+  for (i = 0 ; i < sizeof(test_data32) / sizeof(test_data32[0]) ; i++)
+    munit_assert_uint32(psnip_random_generator_next_u32(&generator), ==, test_data32[i]);
+
+  psnip_random_generator_seed(&generator, 1729);
+  psnip_random_generator_bytes(&generator, sizeof(buf), (psnip_uint8_t*) buf);
+  for (i = 0 ; i < sizeof(buf) / sizeof(buf[0]) ; i++)
+    munit_assert_uint64(buf[i], ==, test_data64[i]);
+
+  munit_assert_int(psnip_random_generator_init(&generator, PSNIP_RANDOM_SOURCE_FAST), ==, 0);
+
+  return MUNIT_OK;
+}
+
+static MunitResult
+test_random_generator_advance(const MunitParameter params[], void* data) {
+  psnip_uint64_t serial[1024];
+  struct PSnipRandomGenerator a, b;
+  size_t i;
+
+  (void) params;
+  (void) data;
+
+  psnip_random_generator_seed_stream(&a, 1729, 42);
+  for (i = 0 ; i < sizeof(serial) / sizeof(serial[0]) ; i++)
+    serial[i] = psnip_random_generator_next_u64(&a);
+
+  /* Jumping ahead should land on the same values as generating
+   * serially. */
+  for (i = 0 ; i < sizeof(serial) / sizeof(serial[0]) ; i += 97) {
+    psnip_random_generator_seed_stream(&b, 1729, 42);
+    psnip_random_generator_advance(&b, i);
+    munit_assert_uint64(psnip_random_generator_next_u64(&b), ==, serial[i]);
+  }
+
+  /* The period is 2^64, so advancing by 2^64 - 1 is one step back. */
+  psnip_random_generator_advance(&b, ~((psnip_uint64_t) 0));
+  munit_assert_uint64(psnip_random_generator_next_u64(&b), ==, serial[i - 97]);
+
+  /* Different streams with the same seed should be unrelated. */
+  psnip_random_generator_seed_stream(&b, 1729, 43);
+  munit_assert_uint64(psnip_random_generator_next_u64(&b), !=, serial[0]);
+
+  return MUNIT_OK;
+}
+
+static MunitResult
+test_random_bulk(const MunitParameter params[], void* data) {
+  /* Large requests take a different (multi-lane) path than small
+   * ones; make sure they still produce the same stream. */
+  static psnip_uint8_t bulk[8192 + 13];
+  static psnip_uint8_t serial[sizeof(bulk)];
+  struct PSnipRandomGenerator generator;
+  psnip_uint64_t v;
+  size_t i;
+
+  (void) params;
+  (void) data;
+
+  psnip_random_generator_seed(&generator, 1729);
+  psnip_random_generator_bytes(&generator, sizeof(bulk), bulk);
+  v = psnip_random_generator_next_u64(&generator);
+  psnip_random_generator_seed(&generator, 1729);
+  for (i = 0 ; i < sizeof(serial) ; i += 128)
+    psnip_random_generator_bytes(&generator, (sizeof(serial) - i) < 128 ? (sizeof(serial) - i) : 128, &(serial[i]));
+  munit_assert_memory_equal(sizeof(bulk), bulk, serial);
+  munit_assert_uint64(v, ==, psnip_random_generator_next_u64(&generator));
+
+  psnip_random_set_seed(1729);
+  munit_assert_int(psnip_random_bytes(PSNIP_RANDOM_SOURCE_REPRODUCIBLE, sizeof(bulk), bulk), ==, 0);
+  psnip_random_set_seed(1729);
+  for (i = 0 ; i < sizeof(serial) ; i += 128)
+    munit_assert_int(psnip_random_bytes(PSNIP_RANDOM_SOURCE_REPRODUCIBLE, (sizeof(serial) - i) < 128 ? (sizeof(serial) - i) : 128, &(serial[i])), ==, 0);
+  munit_assert_memory_equal(sizeof(bulk), bulk, serial);
+
+  return MUNIT_OK;
+}
+
+#if defined(PSNIP_ENABLE_PTHREADS)
+#define TEST_RANDOM_FAST_THREADS 4
+
+static void*
+test_random_fast_threads_worker(void* data) {
+  psnip_uint32_t* buf = (psnip_uint32_t*) data;
+
+  munit_assert_int(psnip_random_bytes(PSNIP_RANDOM_SOURCE_FAST, sizeof(psnip_uint32_t) * 64, (psnip_uint8_t*) buf), ==, 0);
+
+  return NULL;
+}
+
+static MunitResult
+test_random_fast_threads(const MunitParameter params[], void* data) {
+  pthread_t threads[TEST_RANDOM_FAST_THREADS];
+  psnip_uint32_t bufs[TEST_RANDOM_FAST_THREADS][64];
+  size_t i, j;
+
+  (void) params;
+  (void) data;
+
+  for (i = 0 ; i < TEST_RANDOM_FAST_THREADS ; i++)
+    munit_assert_int(pthread_create(&(threads[i]), NULL, test_random_fast_threads_worker, bufs[i]), ==, 0);
+  for (i = 0 ; i < TEST_RANDOM_FAST_THREADS ; i++)
+    pthread_join(threads[i], NULL);
+
+  /* Each thread should have been given its own stream. */
+  for (i = 0 ; i < TEST_RANDOM_FAST_THREADS ; i++)
+    for (j = i + 1 ; j < TEST_RANDOM_FAST_THREADS ; j++)
+      munit_assert_memory_not_equal(sizeof(bufs[i]), bufs[i], bufs[j]);
+
+  return MUNIT_OK;
+}
+#endif
+
+static MunitResult
+test_random_bounded(const MunitParameter params[], void* data) {
+  static psnip_uint32_t u32[1024];
+  static psnip_uint64_t u64[1024];
+  static float f[1024];
+  static double d[1024];
+  struct PSnipRandomGenerator generator;
+  unsigned int counts[6] = { 0, };
+  const psnip_uint64_t big = (((psnip_uint64_t) 1) << 63) + 1;
+  size_t i;
+
+  (void) params;
+  (void) data;
+
+  /* Batches must match the single-value functions exactly. */
+  psnip_random_generator_seed(&generator, 1729);
+  psnip_random_generator_fill_bounded_u32(&generator, 6, 1024, u32);
+  psnip_random_generator_fill_bounded_u64(&generator, big, 1024, u64);
+  psnip_random_generator_fill_float(&generator, 1024, f);
+  psnip_random_generator_fill_double(&generator, 1024, d);
+
+  psnip_random_generator_seed(&generator, 1729);
+  for (i = 0 ; i < 1024 ; i++) {
+    munit_assert_uint32(u32[i], ==, psnip_random_generator_bounded_u32(&generator, 6));
+    counts[u32[i]]++;
+  }
+  for (i = 0 ; i < 1024 ; i++) {
+    munit_assert_uint64(u64[i], ==, psnip_random_generator_bounded_u64(&generator, big));
+    munit_assert_uint64(u64[i], <, big);
+  }
+  for (i = 0 ; i < 1024 ; i++) {
+    munit_assert_true(f[i] == psnip_random_generator_next_float(&generator));
+    munit_assert_float(f[i], >=, 0.0f);
+    munit_assert_float(f[i], <, 1.0f);
+  }
+  for (i = 0 ; i < 1024 ; i++) {
+    munit_assert_true(d[i] == psnip_random_generator_next_double(&generator));
+    munit_assert_double(d[i], >=, 0.0);
+    munit_assert_double(d[i], <, 1.0);
+  }
+
+  /* Very loose; the expected count is ~171. */
+  for (i = 0 ; i < 6 ; i++) {
+    munit_assert_uint(counts[i], >, 100);
+    munit_assert_uint(counts[i], <, 250);
+  }
+
+  munit_assert_uint32(psnip_random_generator_bounded_u32(&generator, 0), ==, 0);
+  munit_assert_uint32(psnip_random_generator_bounded_u32(&generator, 1), ==, 0);
+  munit_assert_uint64(psnip_random_generator_bounded_u64(&generator, 1), ==, 0);
+
+  return MUNIT_OK;
+}
+
+static MunitResult
+test_random_normal(const MunitParameter params[], void* data) {
+  static double normal[65536];
+  static double exponential[65536];
+  struct PSnipRandomGenerator generator;
+  double sum = 0.0, sum_sq = 0.0, below = 0.0;
+  size_t i, n = sizeof(normal) / sizeof(normal[0]);
+
+  (void) params;
+  (void) data;
+
+  psnip_random_generator_seed(&generator, 1729);
+  psnip_random_generator_fill_normal(&generator, n, normal);
+  psnip_random_generator_fill_exponential(&generator, n, exponential);
+
+  psnip_random_generator_seed(&generator, 1729);
+  for (i = 0 ; i < 1024 ; i++)
+    munit_assert_true(normal[i] == psnip_random_generator_next_normal(&generator));
+
+  /* Moments and Φ(1), with generous tolerances. */
+  for (i = 0 ; i < n ; i++) {
+    sum += normal[i];
+    sum_sq += normal[i] * normal[i];
+    if (normal[i] < 1.0)
+      below += 1.0;
+  }
+  munit_assert_double(sum / n, >, -0.02);
+  munit_assert_double(sum / n, <,  0.02);
+  munit_assert_double(sum_sq / n, >, 0.97);
+  munit_assert_double(sum_sq / n, <, 1.03);
+  munit_assert_double(below / n, >, 0.8413 - 0.01);
+  munit_assert_double(below / n, <, 0.8413 + 0.01);
+
+  sum = 0.0;
+  below = 0.0;
+  for (i = 0 ; i < n ; i++) {
+    munit_assert_double(exponential[i], >=, 0.0);
+    sum += exponential[i];
+    if (exponential[i] < 1.0)
+      below += 1.0;
+  }
+  munit_assert_double(sum / n, >, 0.98);
+  munit_assert_double(sum / n, <, 1.02);
+  munit_assert_double(below / n, >, 0.6321 - 0.01);
+  munit_assert_double(below / n, <, 0.6321 + 0.01);
+
+  return MUNIT_OK;
+}
+
+static MunitResult
+test_random_counter(const MunitParameter params[], void* data) {
+  /* Philox4x32-10 known answer (from Random123) for a zero key and
+   * counter. */
+  static const psnip_uint32_t expected[4] = { 0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8 };
+  static psnip_uint8_t stream[4096];
+  static psnip_uint8_t part[sizeof(stream)];
+  const psnip_uint64_t wrap = ((((psnip_uint64_t) 1) << 32) - 3) * 16;
+  psnip_uint32_t block[4];
+  size_t i;
+
+  (void) params;
+  (void) data;
+
+  psnip_random_counter_bytes(0, 0, sizeof(block), (psnip_uint8_t*) block);
+  munit_assert_memory_equal(sizeof(block), block, expected);
+
+  /* Random access, including unaligned offsets and a carry into the
+   * high word of the counter in the middle of a bulk request. */
+  psnip_random_counter_bytes(1729, 0, sizeof(stream), stream);
+  psnip_random_counter_bytes(1729, 37, 1000, part);
+  munit_assert_memory_equal(1000, part, &(stream[37]));
+
+  psnip_random_counter_bytes(1729, wrap, sizeof(stream), stream);
+  for (i = 0 ; i < sizeof(part) ; i += 16)
+    psnip_random_counter_bytes(1729, wrap + i, 16, &(part[i]));
+  munit_assert_memory_equal(sizeof(stream), stream, part);
+
+  /* The source is keyed by the reproducible seed, and requests just
+   * advance the position. */
+  psnip_random_set_seed(1729);
+  munit_assert_int(psnip_random_bytes(PSNIP_RANDOM_SOURCE_COUNTER, 100, part), ==, 0);
+  munit_assert_int(psnip_random_bytes(PSNIP_RANDOM_SOURCE_COUNTER, 900, &(part[100])), ==, 0);
+  psnip_random_counter_bytes(psnip_random_get_seed(), 0, 1000, stream);
+  munit_assert_memory_equal(1000, part, stream);
+
+  return MUNIT_OK;
+}
+
+static MunitResult
+test_random_shuffle(const MunitParameter params[], void* data) {
+  static psnip_uint32_t values[1001];
+  static unsigned char seen[sizeof(values) / sizeof(values[0])];
+  static size_t indices[1000];
+  struct PSnipRandomGenerator generator;
+  struct { psnip_uint8_t bytes[3]; } triples[100];
+  unsigned int counts[5] = { 0, };
+  size_t i, n, moved = 0;
+
+  (void) params;
+  (void) data;
+
+  /* The result must be a permutation, and shouldn't be the identity. */
+  for (i = 0 ; i < sizeof(values) / sizeof(values[0]) ; i++)
+    values[i] = (psnip_uint32_t) i;
+  psnip_random_generator_seed(&generator, 1729);
+  psnip_random_generator_shuffle(&generator, values, sizeof(values) / sizeof(values[0]), sizeof(values[0]));
+  for (i = 0 ; i < sizeof(values) / sizeof(values[0]) ; i++) {
+    munit_assert_uint32(values[i], <, sizeof(values) / sizeof(values[0]));
+    munit_assert_false(seen[values[i]]);
+    seen[values[i]] = 1;
+    if (values[i] != i)
+      moved++;
+  }
+  munit_assert_size(moved, >, 900);
+
+  /* Arbitrary element sizes. */
+  for (i = 0 ; i < sizeof(triples) / sizeof(triples[0]) ; i++)
+    memset(triples[i].bytes, (int) i, sizeof(triples[i].bytes));
+  psnip_random_generator_shuffle(&generator, triples, sizeof(triples) / sizeof(triples[0]), sizeof(triples[0]));
+  memset(seen, 0, sizeof(seen));
+  for (i = 0 ; i < sizeof(triples) / sizeof(triples[0]) ; i++) {
+    munit_assert_uint8(triples[i].bytes[0], ==, triples[i].bytes[2]);
+    munit_assert_false(seen[triples[i].bytes[0]]);
+    seen[triples[i].bytes[0]] = 1;
+  }
+
+  /* Sampling without replacement. */
+  n = psnip_random_generator_sample(&generator, 1000000, 1000, indices);
+  munit_assert_size(n, ==, 1000);
+  for (i = 0 ; i < n ; i++)
+    munit_assert_size(indices[i], <, 1000000);
+  /* w quickly gets smaller than 2^-53 for a population this large. */
+  for (i = 0 ; i < 100 ; i++) {
+    n = psnip_random_generator_sample(&generator, ~((size_t) 0), 1, indices);
+    munit_assert_size(n, ==, 1);
+    munit_assert_size(indices[0], <, ~((size_t) 0));
+  }
+  n = psnip_random_generator_sample(&generator, 10, 1000, indices);
+  munit_assert_size(n, ==, 10);
+  memset(seen, 0, sizeof(seen));
+  for (i = 0 ; i < n ; i++) {
+    munit_assert_size(indices[i], <, 10);
+    munit_assert_false(seen[indices[i]]);
+    seen[indices[i]] = 1;
+  }
+
+  /* Each element should be chosen with probability count/population;
+   * 2 of 5 over 10000 trials is ~4000 each. */
+  for (i = 0 ; i < 10000 ; i++) {
+    psnip_random_generator_sample(&generator, 5, 2, indices);
+    munit_assert_size(indices[0], !=, indices[1]);
+    counts[indices[0]]++;
+    counts[indices[1]]++;
+  }
+  for (i = 0 ; i < 5 ; i++) {
+    munit_assert_uint(counts[i], >, 3700);
+    munit_assert_uint(counts[i], <, 4300);
+  }
+
+  return MUNIT_OK;
+}
+
+/* Big enough to use the blocked, prefetching loop. */
+static MunitResult
+test_random_shuffle_large(const MunitParameter params[], void* data) {
+  const size_t count = 100000;
+  struct PSnipRandomGenerator generator;
+  psnip_uint32_t* values;
+  unsigned char* seen;
+  size_t i;
+
+  (void) params;
+  (void) data;
+
+  values = (psnip_uint32_t*) malloc(count * sizeof(psnip_uint32_t));
+  seen = (unsigned char*) calloc(count, 1);
+  munit_assert_not_null(values);
+  munit_assert_not_null(seen);
+
+  for (i = 0 ; i < count ; i++)
+    values[i] = (psnip_uint32_t) i;
+  psnip_random_generator_seed(&generator, 1729);
+  psnip_random_generator_shuffle(&generator, values, count, sizeof(values[0]));
+  for (i = 0 ; i < count ; i++) {
+    munit_assert_uint32(values[i], <, count);
+    munit_assert_false(seen[values[i]]);
+    seen[values[i]] = 1;
+  }
+
+  free(seen);
+  free(values);
+
+  return MUNIT_OK;
+}
+
+/* Fewer elements than a block, but more than enough bytes to prefetch. */
+static MunitResult
+test_random_shuffle_wide(const MunitParameter params[], void* data) {
+  const size_t count = 40, size = 8192;
+  struct PSnipRandomGenerator generator;
+  psnip_uint8_t* elements;
+  unsigned char seen[40] = { 0, };
+  size_t i, j;
+
+  (void) params;
+  (void) data;
+
+  elements = (psnip_uint8_t*) malloc(count * size);
+  munit_assert_not_null(elements);
+
+  for (i = 0 ; i < count ; i++)
+    memset(elements + (i * size), (int) i, size);
+  psnip_random_generator_seed(&generator, 1729);
+  psnip_random_generator_shuffle(&generator, elements, count, size);
+  for (i = 0 ; i < count ; i++) {
+    for (j = 1 ; j < size ; j++)
+      munit_assert_uint8(elements[(i * size) + j], ==, elements[i * size]);
+    munit_assert_uint8(elements[i * size], <, count);
+    munit_assert_false(seen[elements[i * size]]);
+    seen[elements[i * size]] = 1;
+  }
+
+  free(elements);
+
   return MUNIT_OK;
 }
 
 static MunitTest test_suite_tests[] = {
   { (char*) "/random/secure",       test_random_secure,       NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+  { (char*) "/random/secure/small", test_random_secure_small, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
   { (char*) "/random/reproducible", test_random_reproducible, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
   { (char*) "/random/fast",         test_random_fast,         NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+  { (char*) "/random/hardware",     test_random_hardware,     NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+  { (char*) "/random/generator",    test_random_generator,    NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+  { (char*) "/random/generator/advance", test_random_generator_advance, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+  { (char*) "/random/bulk",         test_random_bulk,         NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+  { (char*) "/random/bounded",      test_random_bounded,      NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+  { (char*) "/random/normal",       test_random_normal,       NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+  { (char*) "/random/counter",      test_random_counter,      NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+  { (char*) "/random/shuffle",      test_random_shuffle,      NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+  { (char*) "/random/shuffle/large", test_random_shuffle_large, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+  { (char*) "/random/shuffle/wide", test_random_shuffle_wide, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+#if defined(PSNIP_ENABLE_PTHREADS)
+  { (char*) "/random/fast/threads", test_random_fast_threads, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+#endif
   { NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
 };
 